@@ -41,16 +41,6 @@ resize(window, W, H)
 
 local gravity_strength = 5.0e6
 
-local function planet_gravity_velocity_func(body, gravity, damping, dt)
-   -- Gravitational acceleration is proportional to the inverse square of
-   -- distance, and directed toward the origin. The central planet is assumed
-   -- to be massive enough that it affects the satellites but not vice versa.
-   local pos = body:get_position()
-   local r = pos:norm()
-   local g = (-gravity_strength/(r^3))*pos
-   body:update_velocity(g, damping, dt)
-end
-
 local function rand_pos(radius)
    while true do
       local v = vec2(math.random()*(FW-2*radius)-(FW/2-radius), math.random()*(FH-2*radius)-(FH/2-radius))
@@ -65,7 +55,11 @@ local function add_box(space)
    local pos = rand_pos(radius)
    local body = cp.body_new(mass, cp.moment_for_poly(mass, verts, {0, 0}, 0.0))
    space:add_body(body)
-   body:set_velocity_update_func(planet_gravity_velocity_func)
+   -- Gravitational acceleration is proportional to the inverse square of
+   -- distance, and directed toward the origin. The central planet is assumed
+   -- to be massive enough that it affects the satellites but not vice versa.
+   -- (This is computed natively: see body:set_force_field()).
+   body:set_force_field('point gravity', {0, 0}, gravity_strength)
    body:set_position(pos)
    -- Set the box's velocity to put it into a circular orbit from its  starting position.
    local r = pos:norm()
@@ -47,27 +47,17 @@ local font = toolbox.font("../ttf-bitstream-vera-1.10/VeraMoBd.ttf", 40/H)
 local chain_count, link_count = 8, 10
 local breaking_force = 80000
 
-local function breakable_joint_post_solve(joint, space)
-   local joint = joint
-   local dt = space:get_current_time_step()
-   -- Convert the impulse to a force by dividing it by the timestep.
-   local force = joint:get_impulse()/dt
-   local maxForce = joint:get_max_force()
-   -- If the force is almost as big as the joint's max force, break it.
-   if force > 0.9*maxForce then
-      space:add_post_step_callback(function(space)
-            space:remove_constraint(joint)
-            joint:free()
-      end)
-   end
-end
-
 local space = cp.space_new()
 local grabber = toolbox.grabber(window, space)
 local grabbable, not_grabbable = grabber:filters()
 space:set_iterations(30)
 space:set_gravity({0, -100})
 space:set_sleep_time_threshold(0.5)
+-- Joints whose force exceeds their break force are removed natively at the end
+-- of the step, and then passed here all together.
+space:set_break_func(function(space, joints)
+   for _, joint in ipairs(joints) do joint:free() end
+end)
 local static_body = space:get_static_body()
 -- Create segments around the edge of the screen.
 local shape = space:add_shape(cp.segment_shape_new(static_body, {-320,-240}, {-320,240}, 0.0))
@@ -107,7 +97,8 @@ for i=0, chain_count-1 do
       end
       space:add_constraint(constraint)
       constraint:set_max_force(breaking_force)
-      constraint:set_post_solve_func(breakable_joint_post_solve)
+      -- Break the joint if the force is almost as big as its max force.
+      constraint:set_break_force(0.9*breaking_force)
       constraint:set_collide_bodies(false)
       prev = body
    end
@@ -51,87 +51,6 @@ local font = toolbox.font("../ttf-bitstream-vera-1.10/VeraMoBd.ttf", 40/H)
 local COLLISION_TYPE_STICKY = 1
 local STICK_SENSOR_THICKNESS = 2.5
 
-local user_data = {} -- user_data for arbiters
-local function set_user_data(arbiter, val)
-   if not val then -- unset
-      local i = arbiter:get_user_index()
-      if user_data[i] then
-         user_data[i]=nil
-         arbiter:set_user_index(0)
-      end
-   else -- set
-      local i =#user_data+1
-      user_data[i]=val
-      arbiter:set_user_index(i)
-   end
-end
-
-local function get_user_data(arbiter)
-   local i = arbiter:get_user_index()
-   return user_data[i]
-end
-
-local function StickyPreSolve(arbiter, space)
-   -- We want to fudge the collisions a bit to allow shapes to overlap more.
-   -- This simulates their squishy sticky surface, and more importantly
-   -- keeps them from separating and destroying the joint.
-   -- Track the deepest collision point and use that to determine if a rigid collision should occur.
-   local deepest = infinity
-   -- Grab the contact set and iterate over them.
-   local normal, points = arbiter:get_contact_point_set()
-   local delta = STICK_SENSOR_THICKNESS*normal
-   for _, point in ipairs(points) do
-      -- Sink the contact points into the surface of each shape.
-      point.a = point.a - delta
-      point.b = point.b + delta
-      deepest = min(deepest, point.distance + 2.0*STICK_SENSOR_THICKNESS)
-   end
-   -- Set the new contact point data.
-   arbiter:set_contact_point_set(normal, points)
-   -- If the shapes are overlapping enough, then create a joint that sticks them together
-   -- at the first contact point.
-   local joint = get_user_data(arbiter)
-   if not joint and deepest <= 0.0 then
-      local bodyA, bodyB = arbiter:get_bodies()
-      -- Create a joint at the contact point to hold the body in place.
-      local anchorA = bodyA:world_to_local(points[1].a)
-      local anchorB = bodyB:world_to_local(points[1].b)
-      local joint = cp.pivot_joint_new(bodyA, bodyB, anchorA, anchorB)
-      -- Give it a finite force for the stickyness.
-      joint:set_max_force(3e3)
-      -- Schedule a post-step() callback to add the joint
-      -- (Notice how here closures come in handy to pass the joint to the callback)
-      space:add_post_step_callback(function(space) space:add_constraint(joint) end)
-      -- Store the joint on the arbiter so we can remove it later.
-      set_user_data(arbiter, joint)
-   end
-   -- Position correction and velocity are handled separately so changing
-   -- the overlap distance alone won't prevent the collision from occuring.
-   -- Explicitly the collision for this frame if the shapes don't overlap using the new distance.
-   return (deepest <= 0.0)
-   -- Lots more that you could improve upon here as well:
-   -- * Modify the joint over time to make it plastic.
-   -- * Modify the joint in the post-step to make it conditionally plastic (like clay).
-   -- * Track a joint for the deepest contact point instead of the first.
-   -- * Track a joint for each contact point. (more complicated since you only get one data pointer).
-end
-
-local function StickySeparate(arbiter, space)
-   local joint = get_user_data(arbiter)
-   if joint then
-      -- The joint won't be removed until the step is done.
-      -- Need to disable it so that it won't apply itself.
-      -- Setting the force to 0 will do just that
-      joint:set_max_force(0.0)
-      -- Perform the removal in a post-step() callback.
-      space:add_post_step_callback(function(space)
-         space:remove_constraint(joint)
-         joint:free()
-      end)
-      set_user_data(arbiter, nil)
-   end
-end
-
 local space = cp.space_new()
 local grabber = toolbox.grabber(window, space)
 local grabbable, not_grabbable = grabber:filters()
@@ -167,8 +86,10 @@ for i=1, 150 do
    shape:set_collision_type(COLLISION_TYPE_STICKY)
 end
 local handler = space:add_wildcard_handler(COLLISION_TYPE_STICKY)
-handler:set_pre_solve_func(StickyPreSolve)
-handler:set_separate_func(StickySeparate)
+-- Contacts are made squishy by sinking them into the shapes, and the shapes are stuck
+-- together by pivot joints with a finite force for the stickyness. This is all done natively
+-- in the handler's pre-solve and separate callbacks (see set_sticky() in the manual).
+handler:set_sticky(STICK_SENSOR_THICKNESS, 3e3)
 
 
 -- Input handling -------------------------------------------------------------
@@ -32,11 +32,12 @@
  * are given to you and then forget about them or copy out the information you need."
  *
  * To avoid creating/destroying userdata at each callback, we use a singleton userdata
- * and a pointer to arbiter_t which we update every time pusharbiter() is called.
+ * (one per Lua state) and a pointer to arbiter_t which we update every time
+ * pusharbiter() is called (the pointer is in the per-state context).
  */
-static ud_t *Ud = NULL;
-static arbiter_t *Arbiter = NULL;
-#define HANDLE ((void*)&Arbiter)
+static const char Handle = 0;
+#define HANDLE ((void*)&Handle) /* the singleton's handle (the same in every state) */
+#define Arbiter (getctx(L)->arbiter)
 
 static int freearbiter(lua_State *L, ud_t *ud)
     {
@@ -46,9 +47,9 @@ static int freearbiter(lua_State *L, ud_t *ud)
 
 static void newarbiter(lua_State *L)
     {
-    Ud = newuserdata(L, HANDLE, ARBITER_MT, "arbiter");
-    Ud->parent_ud = NULL;
-    Ud->destructor = freearbiter;
+    ud_t *ud = newuserdata(L, HANDLE, ARBITER_MT, "arbiter");
+    ud->parent_ud = NULL;
+    ud->destructor = freearbiter;
     lua_pop(L, 1); /* the userdata left by newuserdata() */
     }
 
@@ -61,7 +62,6 @@ int pusharbiter(lua_State *L, arbiter_t *arbiter)
 void invalidatearbiter(lua_State *L, arbiter_t *arbiter)
     {
     Arbiter = NULL;
-    (void)L;
     (void)arbiter;
     }
 
@@ -120,7 +120,7 @@ static int Func(lua_State *L)                           \
     {                                                   \
     arbiter_t *arbiter = checkarbiter(L, 1, NULL);      \
     vec_t val = func(arbiter);                          \
-    pushvec(L, &val);                                   \
+    pushvecout(L, 2, &val);                             \
     return 1;                                           \
     }
 F(GetSurfaceVelocity, cpArbiterGetSurfaceVelocity)
@@ -249,6 +249,300 @@ static int GetUserIndex(lua_State *L)
     return 1;
     }
 
+/*------------------------------------------------------------------------------*
+ | Snapshots                                                                    |
+ *------------------------------------------------------------------------------*/
+
+/* A snapshot is a copy of the arbiter's contact data that can be used after the
+ * callback. The data is kept in a C struct (snapdata_t) recycled through a per-state
+ * pool (a free list in the context): released data is reused by the next
+ * arbiter:snapshot() calls, so that no C allocation is needed in the steady state.
+ * The snapshot itself is a small userdata pointing to the data, that is always new,
+ * so that a released snapshot remains released (its methods raise an error) even if
+ * its data is reused. Live snapshots are tracked in a weak table for bulk release, and
+ * those that are not released return their data to the pool when garbage collected.
+ */
+#define SNAPSHOT_MT "moonchipmunk_arbiter_snapshot"
+static const char LiveKey = 0;
+
+struct moonchipmunk_snapdata_s {
+    snapdata_t *next; /* next in the pool */
+    shape_t *a, *b;
+    body_t *body_a, *body_b;
+    uint64_t serial[4]; /* serial numbers of a, b, body_a, body_b (0 if not bound) */
+    cpHashValue hashid_a, hashid_b;
+    vec_t normal;
+    int count;
+    vec_t point_a[CP_MAX_CONTACTS_PER_ARBITER];
+    vec_t point_b[CP_MAX_CONTACTS_PER_ARBITER];
+    double depth[CP_MAX_CONTACTS_PER_ARBITER];
+    vec_t impulse;
+    double ke;
+    double restitution;
+    double friction;
+    vec_t surface_velocity;
+    int first_contact;
+};
+
+typedef struct {
+    snapdata_t *data; /* NULL if released */
+} snapshot_t;
+
+void freesnapdata(lua_State *L, snapdata_t *pool)
+/* Frees the released data (at the closing of the state) */
+    {
+    snapdata_t *next;
+    for(; pool != NULL; pool = next)
+        { next = pool->next; Free(L, pool); }
+    }
+
+static uint64_t serial(lua_State *L, void *handle)
+    {
+    ud_t *ud = userdata(L, handle);
+    return ud ? ud->serial : 0;
+    }
+
+static snapdata_t *checksnapshot(lua_State *L, int arg)
+    {
+    snapshot_t *snapshot = (snapshot_t*)luaL_checkudata(L, arg, SNAPSHOT_MT);
+    if(!snapshot->data) { luaL_argerror(L, arg, "released snapshot"); return NULL; }
+    return snapshot->data;
+    }
+
+static int Snapshot(lua_State *L)
+    {
+    int i;
+    snapdata_t *snap;
+    snapshot_t *snapshot;
+    ctx_t *ctx = getctx(L);
+    arbiter_t *arbiter = checkarbiter(L, 1, NULL);
+    snapshot = (snapshot_t*)lua_newuserdata(L, sizeof(snapshot_t));
+    snapshot->data = NULL;
+    luaL_setmetatable(L, SNAPSHOT_MT);
+    if(ctx->snapdata)
+        {
+        snap = ctx->snapdata;
+        ctx->snapdata = snap->next;
+        memset(snap, 0, sizeof(snapdata_t));
+        }
+    else
+        snap = (snapdata_t*)Malloc(L, sizeof(snapdata_t));
+    snapshot->data = snap;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &LiveKey);
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    cpArbiterGetShapes(arbiter, &snap->a, &snap->b);
+    cpArbiterGetBodies(arbiter, &snap->body_a, &snap->body_b);
+    snap->serial[0] = serial(L, snap->a);
+    snap->serial[1] = serial(L, snap->b);
+    snap->serial[2] = serial(L, snap->body_a);
+    snap->serial[3] = serial(L, snap->body_b);
+    snap->hashid_a = snap->a->hashid;
+    snap->hashid_b = snap->b->hashid;
+    snap->normal = cpArbiterGetNormal(arbiter);
+    snap->count = cpArbiterGetCount(arbiter);
+    for(i = 0; i < snap->count; i++)
+        {
+        snap->point_a[i] = cpArbiterGetPointA(arbiter, i);
+        snap->point_b[i] = cpArbiterGetPointB(arbiter, i);
+        snap->depth[i] = cpArbiterGetDepth(arbiter, i);
+        }
+    snap->impulse = cpArbiterTotalImpulse(arbiter);
+    snap->ke = cpArbiterTotalKE(arbiter);
+    snap->restitution = cpArbiterGetRestitution(arbiter);
+    snap->friction = cpArbiterGetFriction(arbiter);
+    snap->surface_velocity = cpArbiterGetSurfaceVelocity(arbiter);
+    snap->first_contact = cpArbiterIsFirstContact(arbiter);
+    return 1;
+    }
+
+static void releasesnapshot(ctx_t *ctx, snapshot_t *snapshot)
+/* Releases the snapshot, putting its data in the pool */
+    {
+    if(!snapshot->data) return;
+    snapshot->data->next = ctx->snapdata;
+    ctx->snapdata = snapshot->data;
+    snapshot->data = NULL;
+    }
+
+static int Release(lua_State *L)
+    {
+    (void)checksnapshot(L, 1);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &LiveKey);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    releasesnapshot(getctx(L), (snapshot_t*)lua_touserdata(L, 1));
+    return 0;
+    }
+
+static int SnapshotGC(lua_State *L)
+    {
+    releasesnapshot(getctx(L), (snapshot_t*)lua_touserdata(L, 1));
+    return 0;
+    }
+
+static void newlivetable(lua_State *L)
+    {
+    lua_newtable(L);
+    lua_newtable(L); /* its metatable */
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &LiveKey);
+    }
+
+static int ReleaseSnapshots(lua_State *L)
+    {
+    int live;
+    ctx_t *ctx = getctx(L);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &LiveKey);
+    live = lua_gettop(L);
+    lua_pushnil(L);
+    while(lua_next(L, live) != 0)
+        {
+        lua_pop(L, 1);
+        releasesnapshot(ctx, (snapshot_t*)lua_touserdata(L, -1));
+        }
+    newlivetable(L);
+    return 0;
+    }
+
+static int SnapshotPoolStats(lua_State *L)
+    {
+    lua_Integer nlive = 0, npooled = 0;
+    snapdata_t *snap;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &LiveKey);
+    lua_pushnil(L);
+    while(lua_next(L, -2) != 0) { lua_pop(L, 1); nlive++; }
+    for(snap = getctx(L)->snapdata; snap != NULL; snap = snap->next) npooled++;
+    lua_pushinteger(L, nlive);
+    lua_pushinteger(L, npooled);
+    return 2;
+    }
+
+static void pushobject(lua_State *L, void *handle, uint64_t serial)
+/* Pushes the object, or nil if it has been deleted in the meanwhile. The serial number
+ * is checked so that a new object allocated at the same address is not mistaken for it */
+    {
+    ud_t *ud = handle ? userdata(L, handle) : NULL;
+    if(ud && serial != 0 && ud->serial == serial) pushxxx(L, handle);
+    else lua_pushnil(L);
+    }
+
+static int SnapshotGetShapes(lua_State *L)
+    {
+    snapdata_t *snap = checksnapshot(L, 1);
+    pushobject(L, snap->a, snap->serial[0]);
+    pushobject(L, snap->b, snap->serial[1]);
+    return 2;
+    }
+
+static int SnapshotGetBodies(lua_State *L)
+    {
+    snapdata_t *snap = checksnapshot(L, 1);
+    pushobject(L, snap->body_a, snap->serial[2]);
+    pushobject(L, snap->body_b, snap->serial[3]);
+    return 2;
+    }
+
+static int SnapshotGetHashids(lua_State *L)
+    {
+    snapdata_t *snap = checksnapshot(L, 1);
+    lua_pushinteger(L, snap->hashid_a);
+    lua_pushinteger(L, snap->hashid_b);
+    return 2;
+    }
+
+#define F(Func, field) /* vec_t field */                \
+static int Func(lua_State *L)                           \
+    {                                                   \
+    snapdata_t *snap = checksnapshot(L, 1);             \
+    pushvecout(L, 2, &snap->field);                     \
+    return 1;                                           \
+    }
+F(SnapshotGetNormal, normal)
+F(SnapshotTotalImpulse, impulse)
+F(SnapshotGetSurfaceVelocity, surface_velocity)
+#undef F
+
+#define F(Func, field) /* double field */               \
+static int Func(lua_State *L)                           \
+    {                                                   \
+    snapdata_t *snap = checksnapshot(L, 1);             \
+    lua_pushnumber(L, snap->field);                     \
+    return 1;                                           \
+    }
+F(SnapshotTotalKE, ke)
+F(SnapshotGetRestitution, restitution)
+F(SnapshotGetFriction, friction)
+#undef F
+
+static int SnapshotIsFirstContact(lua_State *L)
+    {
+    snapdata_t *snap = checksnapshot(L, 1);
+    lua_pushboolean(L, snap->first_contact);
+    return 1;
+    }
+
+static int SnapshotGetCount(lua_State *L)
+    {
+    snapdata_t *snap = checksnapshot(L, 1);
+    lua_pushinteger(L, snap->count);
+    return 1;
+    }
+
+static int SnapshotGetPoints(lua_State *L)
+    {
+    int i;
+    snapdata_t *snap = checksnapshot(L, 1);
+    lua_newtable(L); /* point A */
+    lua_newtable(L); /* point B */
+    lua_newtable(L); /* depth */
+    for(i=0; i < snap->count; i++)
+        {
+        pushvec(L, &snap->point_a[i]);
+        lua_rawseti(L, -4, i+1);
+        pushvec(L, &snap->point_b[i]);
+        lua_rawseti(L, -3, i+1);
+        lua_pushnumber(L, snap->depth[i]);
+        lua_rawseti(L, -2, i+1);
+        }
+    return 3;
+    }
+
+static const struct luaL_Reg SnapshotMethods[] = 
+    {
+        { "get_shapes", SnapshotGetShapes },
+        { "get_bodies", SnapshotGetBodies },
+        { "get_hashids", SnapshotGetHashids },
+        { "get_normal", SnapshotGetNormal },
+        { "total_impulse", SnapshotTotalImpulse },
+        { "total_ke", SnapshotTotalKE },
+        { "get_restitution", SnapshotGetRestitution },
+        { "get_friction", SnapshotGetFriction },
+        { "get_surface_velocity", SnapshotGetSurfaceVelocity },
+        { "is_first_contact", SnapshotIsFirstContact },
+        { "get_count", SnapshotGetCount },
+        { "get_points", SnapshotGetPoints },
+        { "release", Release },
+        { NULL, NULL } /* sentinel */
+    };
+
+static void opensnapshots(lua_State *L)
+    {
+    luaL_newmetatable(L, SNAPSHOT_MT);
+    luaL_newlib(L, SnapshotMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, SnapshotGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    newlivetable(L);
+    }
+
 RAW_FUNC(arbiter)
 PARENT_FUNC(arbiter)
 DESTROY_FUNC(arbiter)
@@ -285,6 +579,7 @@ static const struct luaL_Reg Methods[] =
         { "get_bodies", GetBodies },
         { "set_user_index", SetUserIndex },
         { "get_user_index", GetUserIndex },
+        { "snapshot", Snapshot },
         { NULL, NULL } /* sentinel */
     };
 
@@ -296,6 +591,8 @@ static const struct luaL_Reg MetaMethods[] =
 
 static const struct luaL_Reg Functions[] = 
     {
+        { "release_snapshots", ReleaseSnapshots },
+        { "snapshot_pool_stats", SnapshotPoolStats },
         { NULL, NULL } /* sentinel */
     };
 
@@ -304,6 +601,7 @@ void moonchipmunk_open_arbiter(lua_State *L)
     udata_define(L, ARBITER_MT, Methods, MetaMethods);
     luaL_setfuncs(L, Functions, 0);
     newarbiter(L);
+    opensnapshots(L);
     }
 
 #if 0
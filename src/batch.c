@@ -0,0 +1,397 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Stefano Trettel
+ *
+ * Software repository: MoonChipmunk, https://github.com/stetre/moonchipmunk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+#if defined(LINUX)
+#include <pthread.h>
+#endif
+
+/*------------------------------------------------------------------------------*
+ | Worker threads                                                               |
+ *------------------------------------------------------------------------------*/
+
+/* Batches can be split in slices and executed in parallel by a pool of worker
+ * threads (one pool per Lua state, created by set_batch_threads()), with the
+ * calling thread executing the first slice. This is safe because batched queries
+ * do not call Lua, do not modify the space, and write in disjoint output records.
+ * The spatial index must however be read-only during queries, which is true for
+ * the default bounding box tree but not for the spatial hash, so spaces that use
+ * the latter are always queried in the calling thread.
+ */
+
+#define MAX_THREADS 64
+#define MIN_SLICE   64 /* min no. of queries per slice */
+
+/* executes the queries first .. first+n-1 of the batch, and returns the no. of hits */
+typedef size_t (*slicefunc_t)(void *batch, size_t first, size_t n);
+
+#if defined(LINUX)
+
+typedef struct worker_s worker_t;
+
+struct pool_s {
+    int nthreads;               /* no. of worker threads */
+    worker_t *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;       /* signaled when a new job is available (or at quit) */
+    pthread_cond_t done;        /* signaled when all the workers are done with the job */
+    unsigned long generation;   /* incremented at each new job */
+    int pending;                /* no. of workers not yet done with the current job */
+    int quit;
+    /* current job */
+    slicefunc_t func;
+    void *batch;
+    size_t n;
+    int nslices;
+};
+
+struct worker_s {
+    pool_t *pool;
+    pthread_t thread;
+    int index;                  /* index of the slice it executes (1 .. nthreads) */
+    unsigned long generation;   /* generation of the last job seen */
+    size_t hits;
+};
+
+#define SLICE_FIRST(n, nslices, i) ((n)*(i)/(nslices))
+#define SLICE_SIZE(n, nslices, i) (SLICE_FIRST((n), (nslices), (i)+1) - SLICE_FIRST((n), (nslices), (i)))
+
+static void *WorkerThread(void *arg)
+    {
+    worker_t *w = (worker_t*)arg;
+    pool_t *pool = w->pool;
+    pthread_mutex_lock(&pool->mutex);
+    for(;;)
+        {
+        while(pool->generation == w->generation && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        if(pool->quit) break;
+        w->generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+        w->hits = 0;
+        if(w->index < pool->nslices)
+            w->hits = pool->func(pool->batch, SLICE_FIRST(pool->n, pool->nslices, w->index),
+                                    SLICE_SIZE(pool->n, pool->nslices, w->index));
+        pthread_mutex_lock(&pool->mutex);
+        if(--pool->pending == 0) pthread_cond_signal(&pool->done);
+        }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+    }
+
+void freebatchpool(lua_State *L, pool_t *pool)
+    {
+    int i;
+    if(!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for(i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->mutex);
+    Free(L, pool->workers);
+    Free(L, pool);
+    }
+
+static pool_t *newpool(lua_State *L, int nthreads)
+/* Creates a pool with nthreads workers, or returns NULL if the threads can't be created */
+    {
+    int i;
+    pool_t *pool = (pool_t*)Malloc(L, sizeof(pool_t));
+    pool->workers = (worker_t*)Malloc(L, nthreads*sizeof(worker_t));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for(i = 0; i < nthreads; i++)
+        {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i + 1;
+        pool->workers[i].generation = pool->generation; /* set before it starts, so no job is missed */
+        if(pthread_create(&pool->workers[i].thread, NULL, WorkerThread, &pool->workers[i]) != 0)
+            break;
+        pool->nthreads++;
+        }
+    if(pool->nthreads < nthreads) { freebatchpool(L, pool); return NULL; }
+    return pool;
+    }
+
+static size_t runbatch(lua_State *L, int parallel, slicefunc_t func, void *batch, size_t n)
+/* Executes the batch, in parallel if the pool exists and parallel=1 */
+    {
+    int i;
+    size_t hits;
+    pool_t *pool = getctx(L)->pool;
+    int nslices = pool ? pool->nthreads + 1 : 1;
+    if(nslices > 1 && n/MIN_SLICE < (size_t)nslices) nslices = n/MIN_SLICE;
+    if(!parallel || nslices <= 1) return func(batch, 0, n);
+    pthread_mutex_lock(&pool->mutex);
+    pool->func = func;
+    pool->batch = batch;
+    pool->n = n;
+    pool->nslices = nslices;
+    pool->pending = pool->nthreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    hits = func(batch, 0, SLICE_SIZE(n, nslices, 0)); /* first slice */
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    for(i = 0; i < pool->nthreads; i++) hits += pool->workers[i].hits;
+    return hits;
+    }
+
+static int SetBatchThreads(lua_State *L)
+    {
+    ctx_t *ctx = getctx(L);
+    lua_Integer n = luaL_checkinteger(L, 1);
+    if(n < 1 || n > MAX_THREADS) return argerror(L, 1, ERR_RANGE);
+    if(ctx->pool && ctx->pool->nthreads == n - 1) return 0;
+    freebatchpool(L, ctx->pool);
+    ctx->pool = NULL;
+    if(n == 1) return 0;
+    ctx->pool = newpool(L, n - 1);
+    if(!ctx->pool) return failure(L, ERR_OPERATION);
+    return 0;
+    }
+
+static int GetBatchThreads(lua_State *L)
+    {
+    ctx_t *ctx = getctx(L);
+    lua_pushinteger(L, ctx->pool ? ctx->pool->nthreads + 1 : 1);
+    return 1;
+    }
+
+#else /* no pthreads: batches are always executed in the calling thread */
+
+void freebatchpool(lua_State *L, pool_t *pool)
+    { (void)L; (void)pool; }
+
+static size_t runbatch(lua_State *L, int parallel, slicefunc_t func, void *batch, size_t n)
+    { (void)L; (void)parallel; return func(batch, 0, n); }
+
+static int SetBatchThreads(lua_State *L)
+    {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    if(n < 1 || n > MAX_THREADS) return argerror(L, 1, ERR_RANGE);
+    return 0;
+    }
+
+static int GetBatchThreads(lua_State *L)
+    {
+    lua_pushinteger(L, 1);
+    return 1;
+    }
+
+#endif
+
+/*------------------------------------------------------------------------------*
+ | Batched queries                                                              |
+ *------------------------------------------------------------------------------*/
+
+/* Batched queries execute many queries of the same kind in a single call, with the
+ * input and the results packed in binary strings or buffers (as arrays of doubles).
+ * Each query of a batch writes in its own output record, independently of the others.
+ */
+
+#define HASHID(shape) ((shape) ? (double)(shape)->hashid : -1.0)
+
+typedef struct {
+    space_t *space;
+    const double *in;   /* input records */
+    double *out;        /* output records */
+    size_t n;           /* no. of queries */
+    size_t insize;      /* no. of doubles per input record */
+    double radius;      /* radius, or maxdist */
+    cpShapeFilter filter;
+} batch_t;
+
+static void optfilter(lua_State *L, int arg, cpShapeFilter *filter)
+    {
+    if(lua_isnoneornil(L, arg)) *filter = CP_SHAPE_FILTER_ALL;
+    else checkshapefilter(L, arg, filter);
+    }
+
+static size_t checkinput(lua_State *L, int arg, size_t recsize, const double **in)
+/* Checks the packed input at arg, and returns the number of records it contains */
+    {
+    size_t size;
+    *in = (const double*)checkdata(L, arg, &size);
+    if(size % (recsize*sizeof(double)) != 0) argerror(L, arg, ERR_LENGTH);
+    return size / (recsize*sizeof(double));
+    }
+
+static double *checkoutput(lua_State *L, int arg, size_t size, luaL_Buffer *buf)
+/* Returns the destination for size bytes of output: either the buffer at arg,
+ * or (if arg is none or nil) a Lua buffer, to be pushed as a binary string */
+    {
+    size_t bufsize;
+    double *out;
+    if(lua_isnoneornil(L, arg))
+        return (double*)luaL_buffinitsize(L, buf, size);
+    out = (double*)checkbuffer(L, arg, &bufsize);
+    if(bufsize < size) argerror(L, arg, ERR_LENGTH);
+    return out;
+    }
+
+static int pushoutput(lua_State *L, int arg, size_t size, luaL_Buffer *buf, size_t hits)
+    {
+    if(lua_isnoneornil(L, arg))
+        {
+        luaL_pushresultsize(buf, size);
+        lua_pushinteger(L, hits);
+        return 2;
+        }
+    lua_pushinteger(L, hits);
+    return 1;
+    }
+
+/* segment_query_first_batch ----------------------------------------------------
+ * input: {x1, y1, x2, y2} per ray
+ * output: {hashid|-1, px, py, nx, ny, alpha} per ray
+ */
+#define SQ_IN 4
+#define SQ_OUT 6
+
+static size_t segmentqueryfirst(void *batch, size_t first, size_t n)
+    {
+    batch_t *b = (batch_t*)batch;
+    size_t i, hits = 0;
+    const double *in;
+    double *out;
+    const shape_t *shape;
+    cpSegmentQueryInfo info;
+    for(i = first; i < first + n; i++)
+        {
+        in = b->in + i*b->insize;
+        out = b->out + i*SQ_OUT;
+        shape = cpSpaceSegmentQueryFirst(b->space, cpv(in[0], in[1]), cpv(in[2], in[3]),
+                        b->radius, b->filter, &info);
+        if(shape) hits++;
+        out[0] = HASHID(shape);
+        out[1] = info.point.x;
+        out[2] = info.point.y;
+        out[3] = info.normal.x;
+        out[4] = info.normal.y;
+        out[5] = info.alpha;
+        }
+    return hits;
+    }
+
+static int SegmentQueryFirstBatch(lua_State *L)
+    {
+    double t0;
+    ud_t *ud;
+    batch_t b;
+    size_t size, hits;
+    luaL_Buffer buf;
+    b.space = checkspace(L, 1, &ud);
+    b.insize = SQ_IN;
+    b.n = checkinput(L, 2, SQ_IN, &b.in);
+    b.radius = luaL_checknumber(L, 3);
+    checkshapefilter(L, 4, &b.filter);
+    size = b.n*SQ_OUT*sizeof(double);
+    b.out = checkoutput(L, 5, size, &buf);
+    t0 = tracebegin(spacectx(b.space));
+    hits = runbatch(L, !usesspatialhash(ud), segmentqueryfirst, &b, b.n);
+    traceend(spacectx(b.space), "query", "segment_query_first_batch", t0);
+    return pushoutput(L, 5, size, &buf, hits);
+    }
+
+/* point_query_nearest_batch ----------------------------------------------------
+ * input: {x, y} per point, or {x, y, maxdist} if maxdist is not given for the batch
+ * output: {hashid|-1, px, py, distance, gx, gy} per point
+ */
+#define PQ_OUT 6
+
+static size_t pointquerynearest(void *batch, size_t first, size_t n)
+    {
+    batch_t *b = (batch_t*)batch;
+    size_t i, hits = 0;
+    const double *in;
+    double *out;
+    const shape_t *shape;
+    cpPointQueryInfo info;
+    for(i = first; i < first + n; i++)
+        {
+        in = b->in + i*b->insize;
+        out = b->out + i*PQ_OUT;
+        shape = cpSpacePointQueryNearest(b->space, cpv(in[0], in[1]),
+                        b->insize == 3 ? in[2] : b->radius, b->filter, &info);
+        if(shape) hits++;
+        out[0] = HASHID(shape);
+        out[1] = info.point.x;
+        out[2] = info.point.y;
+        out[3] = info.distance;
+        out[4] = info.gradient.x;
+        out[5] = info.gradient.y;
+        }
+    return hits;
+    }
+
+static int PointQueryNearestBatch(lua_State *L)
+    {
+    double t0;
+    ud_t *ud;
+    batch_t b;
+    size_t size, hits;
+    luaL_Buffer buf;
+    b.space = checkspace(L, 1, &ud);
+    b.radius = luaL_optnumber(L, 3, 0);
+    b.insize = lua_isnoneornil(L, 3) ? 3 : 2;
+    b.n = checkinput(L, 2, b.insize, &b.in);
+    optfilter(L, 4, &b.filter);
+    size = b.n*PQ_OUT*sizeof(double);
+    b.out = checkoutput(L, 5, size, &buf);
+    t0 = tracebegin(spacectx(b.space));
+    hits = runbatch(L, !usesspatialhash(ud), pointquerynearest, &b, b.n);
+    traceend(spacectx(b.space), "query", "point_query_nearest_batch", t0);
+    return pushoutput(L, 5, size, &buf, hits);
+    }
+
+static const struct luaL_Reg SpaceMethods[] =
+    {
+        { "segment_query_first_batch", SegmentQueryFirstBatch },
+        { "point_query_nearest_batch", PointQueryNearestBatch },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] =
+    {
+        { "set_batch_threads", SetBatchThreads },
+        { "get_batch_threads", GetBatchThreads },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonchipmunk_open_batch(lua_State *L)
+    {
+    udata_addmethods(L, SPACE_MT, SpaceMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
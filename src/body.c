@@ -31,14 +31,18 @@ static void removeconstraint(body_t *body, constraint_t *constraint, void *data)
 static void removeshape(body_t *body, shape_t *shape, void *data)
     { cpSpaceRemoveShape((space_t*)data, shape); (void)body; }
 
+static void clearfields(body_t *body);
+
 int freebody(lua_State *L, ud_t *ud)
     {
     space_t *space;
     body_t *body = (body_t*)ud->handle;
     if(!IsValid(ud)) return 0;
     space = cpBodyGetSpace(body);
+    if(space && spacebusy(L, space)) return failure(L, ERR_OPERATION); /* async step in progress */
     if(space && cpSpaceIsLocked(space)) return 0; /* leave it to post step */
 //  freechildren(L, _MT, ud);
+    if(ud->info) clearfields(body); /* ud->info is released by freeuserdata() */
     if(!freeuserdata(L, ud, "body")) return 0;
     if(!IsBorrowed(ud))
         {
@@ -133,6 +137,14 @@ static int GetIdleTime(lua_State *L)
     return 1;
     }
 
+static int GetId(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkbody(L, 1, &ud);
+    lua_pushinteger(L, (lua_Integer)ud->serial);
+    return 1;
+    }
+
 #define F(Func, func) /* void func(body, vec_t) */      \
 static int Func(lua_State *L)                           \
     {                                                   \
@@ -153,7 +165,7 @@ static int Func(lua_State *L)                           \
     {                                                   \
     body_t *body = checkbody(L, 1, NULL);               \
     vec_t val = func(body);                             \
-    pushvec(L, &val);                                   \
+    pushvecout(L, 2, &val);                             \
     return 1;                                           \
     }
 F(GetPosition, cpBodyGetPosition)
@@ -186,7 +198,7 @@ static int Func(lua_State *L)                           \
     body_t *body = checkbody(L, 1, NULL);               \
     checkvec(L, 2, &val);                               \
     res = func(body, val);                              \
-    pushvec(L, &res);                                   \
+    pushvecout(L, 3, &res);                             \
     return 1;                                           \
     }
 F(LocalToWorld, cpBodyLocalToWorld)
@@ -265,12 +277,12 @@ static int UpdateVelocity(lua_State *L)
 #define F(Func, What, what)                                                 \
 static void IteratorFunc##What(body_t *body, what##_t *what, void *data)    \
     {                                                                       \
-    lua_State *L = moonchipmunk_L;                                          \
+    lua_State *L = (lua_State*)data;                                        \
     int top = lua_gettop(L);                                                \
+    if(!userdata(L, what)) return; /* not visible to Lua (native joint) */  \
     lua_pushvalue(L, 2);    /* the function */                              \
     pushbody(L, body);                                                      \
     push##what(L, what);                                                    \
-    (void)data;                                                             \
     if(lua_pcall(L, 2, 0, 0) != LUA_OK)                                     \
         { lua_error(L); return; }                                           \
     lua_settop(L, top);                                                     \
@@ -279,7 +291,7 @@ static int Func(lua_State *L)                                               \
     {                                                                       \
     body_t *body = checkbody(L, 1, NULL);                                   \
     if(!lua_isfunction(L, 2)) return argerror(L, 2, ERR_FUNCTION);          \
-    cpBodyEach##What(body, IteratorFunc##What, NULL);                       \
+    cpBodyEach##What(body, IteratorFunc##What, L);                          \
     return 0;                                                               \
     }
 F(EachShape, Shape, shape)
@@ -288,12 +300,11 @@ F(EachConstraint, Constraint, constraint)
 
 static void IteratorFuncArbiter(body_t *body, arbiter_t *arbiter, void *data)
     {
-    lua_State *L = moonchipmunk_L;
+    lua_State *L = (lua_State*)data;
     int top = lua_gettop(L);
     lua_pushvalue(L, 2);    /* the function */
     pushbody(L, body);
     pusharbiter(L, arbiter);
-    (void)data;
     if(lua_pcall(L, 2, 0, 0) != LUA_OK)
         { invalidatearbiter(L, arbiter); lua_error(L); return; }
     invalidatearbiter(L, arbiter);
@@ -304,38 +315,43 @@ static int EachArbiter(lua_State *L)
     {
     body_t *body = checkbody(L, 1, NULL);
     if(!lua_isfunction(L, 2)) return argerror(L, 2, ERR_FUNCTION);
-    cpBodyEachArbiter(body, IteratorFuncArbiter, NULL);
+    cpBodyEachArbiter(body, IteratorFuncArbiter, L);
     return 0;
     }
 
 static void BodyVelocityFunc(body_t *body, vec_t gravity, double damping, double dt)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
-    ud_t *ud = userdata(body);
+    lua_State *L = spacectx(cpBodyGetSpace(body))->L;
+    ud_t *ud = userdata(L, body);
     int top = lua_gettop(L);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
     pushbody(L, body);
     pushvec(L, &gravity);
     lua_pushnumber(L, damping);
     lua_pushnumber(L, dt);
-    rc = lua_pcall(L, 4, 0, 0);
+    rc = timedpcall(L, cpBodyGetSpace(body), CALLBACK_BODY, 4, 0);
     if(rc!=LUA_OK) lua_error(L);
     lua_settop(L, top);
     }
 
+static void resetfields(ud_t *ud);
+
 static int SetVelocityUpdateFunc(lua_State *L)
     {
     ud_t *ud;
     body_t *body = checkbody(L, 1, &ud);
+    resetfields(ud); /* both a Lua function and the default replace the force fields */
     if(lua_isnoneornil(L, 2))
         {
         Unreference(L, ud->ref1);
+        cpBodySetUserData(body, NULL);
         cpBodySetVelocityUpdateFunc(body, cpBodyUpdateVelocity);
         return 0;
         }
     if(!lua_isfunction(L, 2)) return argerror(L, 2, ERR_FUNCTION);
     Reference(L, 2, ud->ref1);
+    cpBodySetUserData(body, NULL); /* no force fields */
     cpBodySetVelocityUpdateFunc(body, BodyVelocityFunc);
     return 0;
     }
@@ -343,13 +359,13 @@ static int SetVelocityUpdateFunc(lua_State *L)
 static void BodyPositionFunc(body_t *body, double dt)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
-    ud_t *ud = userdata(body);
+    lua_State *L = spacectx(cpBodyGetSpace(body))->L;
+    ud_t *ud = userdata(L, body);
     int top = lua_gettop(L);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref2);
     pushbody(L, body);
     lua_pushnumber(L, dt);
-    rc = lua_pcall(L, 2, 0, 0);
+    rc = timedpcall(L, cpBodyGetSpace(body), CALLBACK_BODY, 2, 0);
     if(rc!=LUA_OK) lua_error(L);
     lua_settop(L, top);
     }
@@ -370,9 +386,147 @@ static int SetPositionUpdateFunc(lua_State *L)
     return 0;
     }
 
+int bodycallslua(body_t *body)
+/* Returns 1 if the body has Lua velocity or position update functions */
+    {
+    return body->velocity_func == BodyVelocityFunc || body->position_func == BodyPositionFunc;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Force fields                                                                 |
+ *------------------------------------------------------------------------------*/
+
+/* Force fields are native velocity update functions, configured by parameters,
+ * that replace the Lua velocity update functions for the common cases (planetary
+ * gravity, wind, drag). The parameters are per-body, in ud->info, and the body's
+ * user data points to them so that they can be found without a lookup.
+ * Gravity terms are accelerations (like the space's gravity), while wind and drag
+ * are forces (so that heavier bodies are less affected). */
+
+#define FIELD(f) (1 << (f)) /* FORCE_FIELD_XXX -> bit in fields_t.mask */
+
+typedef struct {
+    int mask; /* active fields */
+    double gravity_scale; /* FORCE_FIELD_GRAVITY_SCALE */
+    vec_t center; double strength; double min_radius; /* FORCE_FIELD_POINT_GRAVITY */
+    vec_t wind; double wind_k; int wind_bb; bb_t wind_region; /* FORCE_FIELD_WIND */
+    double linear_k; /* FORCE_FIELD_LINEAR_DRAG */
+    double quadratic_k; /* FORCE_FIELD_QUADRATIC_DRAG */
+} fields_t;
+
+static void FieldsVelocityFunc(body_t *body, vec_t gravity, double damping, double dt)
+    {
+    double r2, r;
+    fields_t *f = (fields_t*)cpBodyGetUserData(body);
+    vec_t p = cpBodyGetPosition(body);
+    vec_t v = cpBodyGetVelocity(body);
+    vec_t g = gravity, force = cpvzero, d;
+    /* cpBodyUpdateVelocity() ignores kinematic bodies without resetting their force,
+     * so the force added here would accumulate at each step */
+    if(cpBodyGetType(body) != CP_BODY_TYPE_DYNAMIC) return;
+    if(f->mask & FIELD(FORCE_FIELD_GRAVITY_SCALE))
+        g = cpvmult(g, f->gravity_scale);
+    if(f->mask & FIELD(FORCE_FIELD_POINT_GRAVITY))
+        { /* g = -strength * d / |d|^3, with d = p - center (1/r^2 falloff) */
+        d = cpvsub(p, f->center);
+        r2 = cpvlengthsq(d);
+        if(r2 < f->min_radius*f->min_radius) r2 = f->min_radius*f->min_radius;
+        if(r2 > 0)
+            {
+            r = sqrt(r2);
+            g = cpvadd(g, cpvmult(d, -f->strength/(r2*r)));
+            }
+        }
+    if(f->mask & FIELD(FORCE_FIELD_WIND))
+        {
+        if(!f->wind_bb || cpBBContainsVect(f->wind_region, p))
+            force = cpvadd(force, cpvmult(cpvsub(f->wind, v), f->wind_k));
+        }
+    if(f->mask & FIELD(FORCE_FIELD_LINEAR_DRAG))
+        force = cpvsub(force, cpvmult(v, f->linear_k));
+    if(f->mask & FIELD(FORCE_FIELD_QUADRATIC_DRAG))
+        force = cpvsub(force, cpvmult(v, f->quadratic_k*cpvlength(v)));
+    cpBodySetForce(body, cpvadd(cpBodyGetForce(body), force));
+    cpBodyUpdateVelocity(body, g, damping, dt);
+    }
+
+static void clearfields(body_t *body)
+    {
+    if(cpBodyGetUserData(body) == NULL) return;
+    cpBodySetVelocityUpdateFunc(body, cpBodyUpdateVelocity);
+    cpBodySetUserData(body, NULL);
+    }
+
+static int SetForceField(lua_State *L)
+    {
+    ud_t *ud;
+    fields_t *f;
+    body_t *body = checkbody(L, 1, &ud);
+    int field = checkforcefield(L, 2);
+    if(!ud->info) ud->info = Malloc(L, sizeof(fields_t));
+    f = (fields_t*)ud->info;
+    switch(field)
+        {
+        case FORCE_FIELD_GRAVITY_SCALE:
+                f->gravity_scale = luaL_checknumber(L, 3);
+                break;
+        case FORCE_FIELD_POINT_GRAVITY:
+                checkvec(L, 3, &f->center);
+                f->strength = luaL_checknumber(L, 4);
+                f->min_radius = luaL_optnumber(L, 5, 0);
+                break;
+        case FORCE_FIELD_WIND:
+                checkvec(L, 3, &f->wind);
+                f->wind_k = luaL_checknumber(L, 4);
+                f->wind_bb = !lua_isnoneornil(L, 5);
+                if(f->wind_bb) checkbb(L, 5, &f->wind_region);
+                break;
+        case FORCE_FIELD_LINEAR_DRAG:
+                f->linear_k = luaL_checknumber(L, 3);
+                break;
+        case FORCE_FIELD_QUADRATIC_DRAG:
+                f->quadratic_k = luaL_checknumber(L, 3);
+                break;
+        default: return unexpected(L);
+        }
+    f->mask |= FIELD(field);
+    Unreference(L, ud->ref1); /* replaces the Lua velocity update function, if any */
+    cpBodySetUserData(body, f);
+    cpBodySetVelocityUpdateFunc(body, FieldsVelocityFunc);
+    return 0;
+    }
+
+static void resetfields(ud_t *ud)
+/* Deactivates all the fields, so that they are not restored by the next set_force_field() */
+    { if(ud->info) ((fields_t*)ud->info)->mask = 0; }
+
+static int ClearForceFields(lua_State *L)
+    {
+    ud_t *ud;
+    body_t *body = checkbody(L, 1, &ud);
+    resetfields(ud);
+    clearfields(body);
+    return 0;
+    }
+
+static int GetForceFields(lua_State *L)
+    {
+    ud_t *ud;
+    int field, n = 0;
+    (void)checkbody(L, 1, &ud);
+    if(!ud->info || cpBodyGetUserData((body_t*)ud->handle) == NULL) return 0;
+    for(field = FORCE_FIELD_GRAVITY_SCALE; field <= FORCE_FIELD_QUADRATIC_DRAG; field++)
+        {
+        if(((fields_t*)ud->info)->mask & FIELD(field))
+            { pushforcefield(L, field); n++; }
+        }
+    return n;
+    }
+
 RAW_FUNC(body)
 PARENT_FUNC(body)
 DESTROY_FUNC(body)
+GC_FUNC(body, cpBodyGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -393,6 +547,7 @@ static const struct luaL_Reg Methods[] =
         { "kinetic_energy", KineticEnergy },
         { "is_sleeping", IsSleeping },
         { "get_idle_time", GetIdleTime },
+        { "get_id", GetId },
         { "set_position", SetPosition },
         { "set_center_of_gravity", SetCenterOfGravity },
         { "set_velocity", SetVelocity },
@@ -423,12 +578,15 @@ static const struct luaL_Reg Methods[] =
         { "each_arbiter", EachArbiter },
         { "set_velocity_update_func", SetVelocityUpdateFunc },
         { "set_position_update_func", SetPositionUpdateFunc },
+        { "set_force_field", SetForceField },
+        { "clear_force_fields", ClearForceFields },
+        { "get_force_fields", GetForceFields },
         { NULL, NULL } /* sentinel */
     };
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -28,7 +28,7 @@
 static int freecircle(lua_State *L, ud_t *ud)
     {
     shape_t *shape = (shape_t*)ud->handle;
-    if(!candestroyshape(shape, ud)) return 0;
+    if(!candestroyshape(L, shape, ud)) return 0;
     if(!freeuserdata(L, ud, "circle")) return 0;
     shapedestroy(L, (shape_t*)shape);
     return 0;
@@ -59,7 +59,7 @@ static int GetOffset(lua_State *L)
     {
     shape_t *circle = checkcircle(L, 1, NULL);
     vec_t offset = cpCircleShapeGetOffset(circle);
-    pushvec(L, &offset);
+    pushvecout(L, 2, &offset);
     return 1;
     }
 
@@ -90,6 +90,7 @@ static int SetRadius(lua_State *L)
 
 
 DESTROY_FUNC(circle)
+GC_FUNC(circle, cpShapeGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -103,7 +104,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
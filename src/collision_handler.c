@@ -25,9 +25,83 @@
 
 #include "internal.h"
 
+/* The handler's callbacks are set to the functions below only if needed, i.e. if
+ * a Lua callback is set (ud->ref1..4) or some native processing is enabled (info).
+ * The original callbacks (Chipmunk's defaults, which call the wildcard handlers)
+ * are saved at creation, and used whenever there is no Lua callback, or restored
+ * when the callback is no longer needed. */
+#define MAX_RULES 8 /* max no. of pre-solve rules per handler */
+
+typedef struct { /* collision matrix cell */
+    unsigned char action; /* COLLISION_ACTION_XXX */
+    unsigned char events; /* recorded events (COLLISION_EVENT_XXX flags) */
+    unsigned char hasrule;
+    rule_t rule; /* pre-solve rule, for the (type_a, type_b) order of shapes */
+} cell_t;
+
+typedef struct { /* collision matrix, for types 0 .. ntypes-1 */
+    int ntypes;
+    cell_t cells[1]; /* ntypes x ntypes */
+} matrix_t;
+
+typedef struct { /* sticky mode parameters */
+    double thickness; /* contact points are sunk by this much in each shape */
+    double max_force; /* max force of the joints */
+    double break_distance; /* max distance between the anchors (0 = unlimited) */
+    int surface; /* 1 if the joints are bound to Lua pivot_joint objects */
+} sticky_t;
+
+typedef struct stick_s stick_t;
+
+typedef struct {
+    cpCollisionBeginFunc beginFunc; /* original callbacks and user data */
+    cpCollisionPreSolveFunc preSolveFunc;
+    cpCollisionPostSolveFunc postSolveFunc;
+    cpCollisionSeparateFunc separateFunc;
+    cpDataPointer userData;
+    int events; /* recorded events (COLLISION_EVENT_XXX flags) */
+    records_t *ring; /* the space's events ring */
+    int impacts; /* 1 if post-solve impacts are recorded */
+    double threshold; /* min. impulse magnitude for an impact to be recorded */
+    records_t *hits; /* the space's impacts array */
+    int nrules; /* native pre-solve rules */
+    rule_t rules[MAX_RULES];
+    matrix_t *matrix; /* collision matrix, or NULL */
+    int hasfluid; /* 1 if shape a is a native fluid */
+    fluid_t fluid;
+    int hassticky; /* 1 if touching shapes are stuck together with pivot joints */
+    sticky_t sticky;
+    cpHashSet *sticks; /* records of the joints created in sticky mode (stick_t), or NULL */
+} info_t;
+
+static void releasesticks(lua_State *L, info_t *info, space_t *space);
+
+static void restorehandler(collision_handler_t *handler, info_t *info)
+    {
+    handler->beginFunc = info->beginFunc;
+    handler->preSolveFunc = info->preSolveFunc;
+    handler->postSolveFunc = info->postSolveFunc;
+    handler->separateFunc = info->separateFunc;
+    handler->userData = info->userData;
+    }
+
 static int freecollision_handler(lua_State *L, ud_t *ud)
     {
-    //collision_handler_t *handler = (collision_handler_t*)ud->handle;
+    collision_handler_t *handler = (collision_handler_t*)ud->handle;
+    info_t *info = (info_t*)ud->info;
+    if(IsValid(ud) && ud->parent_ud && asyncbusy(ud->parent_ud))
+        return failure(L, ERR_OPERATION); /* async step in progress */
+    if(IsValid(ud))
+        {
+        restorehandler(handler, info);
+        if(info->matrix) { Free(L, info->matrix); info->matrix = NULL; }
+        if(info->sticks)
+            {
+            if(ud->parent_ud) releasesticks(L, info, (space_t*)ud->parent_ud->handle);
+            cpHashSetFree(info->sticks);
+            info->sticks = NULL;
+            }
+        }
     if(!freeuserdata(L, ud, "collision_handler")) return 0;
     return 0;
     }
@@ -35,11 +109,21 @@ static int freecollision_handler(lua_State *L, ud_t *ud)
 int newcollision_handler(lua_State *L, collision_handler_t *handler, space_t *space)
     {
     ud_t *ud;
-    if(userdata(handler)) /* already in */
+    info_t *info;
+    if(userdata(L, handler)) /* already in */
         return pushcollision_handler(L, handler);
+    info = (info_t*)Malloc(L, sizeof(info_t));
+    info->beginFunc = handler->beginFunc;
+    info->preSolveFunc = handler->preSolveFunc;
+    info->postSolveFunc = handler->postSolveFunc;
+    info->separateFunc = handler->separateFunc;
+    info->userData = handler->userData;
     ud = newuserdata(L, handler, COLLISION_HANDLER_MT, "collision_handler");
-    ud->parent_ud = userdata(space);
+    setparent(ud, userdata(L, space));
+    info->ring = spaceevents(ud->parent_ud);
+    info->hits = spaceimpacts(ud->parent_ud);
     ud->destructor = freecollision_handler;
+    ud->info = info;
     handler->userData = ud;
     return 1;
     }
@@ -52,17 +136,366 @@ static int GetTypes(lua_State *L)
     return 2;
     }
 
+static void recordevent(lua_State *L, info_t *info, int event, cpArbiter *arbiter)
+/* Appends an event record to the space's events ring */
+    {
+    shape_t *a, *b;
+    vec_t n, p, j;
+    double *rec = newrecord(L, info->ring);
+    cpArbiterGetShapes(arbiter, &a, &b);
+    n = cpArbiterGetNormal(arbiter);
+    p = cpArbiterGetCount(arbiter) > 0 ? cpArbiterGetPointA(arbiter, 0) : cpvzero;
+    /* impulses are available only after the arbiter has been solved */
+    j = event == COLLISION_EVENT_POST_SOLVE ? cpArbiterTotalImpulse(arbiter) : cpvzero;
+    rec[0] = event;
+    rec[1] = a->hashid;
+    rec[2] = b->hashid;
+    rec[3] = n.x;
+    rec[4] = n.y;
+    rec[5] = p.x;
+    rec[6] = p.y;
+    rec[7] = j.x;
+    rec[8] = j.y;
+    rec[9] = event == COLLISION_EVENT_POST_SOLVE ? cpArbiterTotalKE(arbiter) : 0.0;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Native pre-solve rules                                                       |
+ *------------------------------------------------------------------------------*/
+
+/* Pre-solve rules cover the common uses of a pre-solve callback (one-way platforms,
+ * per-pair surface properties) without calling Lua. They are applied in order, and
+ * the first rule that ignores the contact stops the chain. */
+
+int checkrule(lua_State *L, int arg, rule_t *rule)
+/* Checks a rule given as (kind, parameters...) starting from arg */
+    {
+    memset(rule, 0, sizeof(rule_t));
+    rule->kind = checkpresolverule(L, arg);
+    switch(rule->kind)
+        {
+        case RULE_IGNORE_IF_NORMAL:
+                checkvec(L, arg+1, &rule->v);
+                rule->k = luaL_optnumber(L, arg+2, 0);
+                return 0;
+        case RULE_IGNORE_AFTER_FIRST_CONTACT:
+                return 0;
+        case RULE_FRICTION:
+        case RULE_ELASTICITY:
+                rule->k = luaL_checknumber(L, arg+1);
+                return 0;
+        case RULE_SURFACE_VELOCITY:
+                checkvec(L, arg+1, &rule->v);
+                return 0;
+        default: return unexpected(L);
+        }
+    return 0;
+    }
+
+cpBool applyrules(const rule_t *rules, int nrules, cpArbiter *arbiter)
+/* Applies the rules to the arbiter, and returns cpFalse if the contact is to be ignored */
+    {
+    int i;
+    const rule_t *rule;
+    for(i = 0; i < nrules; i++)
+        {
+        rule = &rules[i];
+        switch(rule->kind)
+            {
+            case RULE_IGNORE_IF_NORMAL:
+                if(cpvdot(cpArbiterGetNormal(arbiter), rule->v) < rule->k)
+                    return cpArbiterIgnore(arbiter);
+                break;
+            case RULE_IGNORE_AFTER_FIRST_CONTACT:
+                if(!cpArbiterIsFirstContact(arbiter))
+                    return cpArbiterIgnore(arbiter);
+                break;
+            case RULE_FRICTION: cpArbiterSetFriction(arbiter, rule->k); break;
+            case RULE_ELASTICITY: cpArbiterSetRestitution(arbiter, rule->k); break;
+            case RULE_SURFACE_VELOCITY: cpArbiterSetSurfaceVelocity(arbiter, rule->v); break;
+            default: break;
+            }
+        }
+    return cpTrue;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Collision matrix                                                             |
+ *------------------------------------------------------------------------------*/
+
+/* A collision matrix gives the native treatment of each pair of collision types,
+ * so that a single handler (typically the default one) can serve many types, with
+ * a lookup instead of a Lua callback. Only the cells with the 'script' action (the
+ * default) are passed to the handler's Lua callbacks, if any.
+ * Cells are symmetric: the cell for (a, b) is stored at [min][max], and its rule is
+ * reversed if the arbiter's shapes come in the other order. */
+
+#define CELL(m, a, b) (&(m)->cells[(a)*(m)->ntypes + (b)])
+
+static const cell_t *lookup(const info_t *info, cpArbiter *arbiter, int *swapped)
+/* Returns the cell for the arbiter's shapes, or NULL if they are to be scripted */
+    {
+    shape_t *a, *b;
+    cpCollisionType ta, tb;
+    const cell_t *cell;
+    const matrix_t *m = info->matrix;
+    if(!m) return NULL;
+    cpArbiterGetShapes(arbiter, &a, &b);
+    ta = cpShapeGetCollisionType(a);
+    tb = cpShapeGetCollisionType(b);
+    if(ta >= (cpCollisionType)m->ntypes || tb >= (cpCollisionType)m->ntypes) return NULL;
+    *swapped = ta > tb;
+    cell = *swapped ? CELL(m, tb, ta) : CELL(m, ta, tb);
+    return cell->action == COLLISION_ACTION_SCRIPT ? NULL : cell;
+    }
+
+static cpBool applycellrule(const cell_t *cell, int swapped, cpArbiter *arbiter)
+    {
+    rule_t rule;
+    if(!cell->hasrule) return cpTrue;
+    if(!swapped) return applyrules(&cell->rule, 1, arbiter);
+    rule = cell->rule;
+    rule.v = cpvneg(rule.v);
+    return applyrules(&rule, 1, arbiter);
+    }
+
+/*------------------------------------------------------------------------------*
+ | Callbacks                                                                    |
+ *------------------------------------------------------------------------------*/
+
+static void recordimpact(lua_State *L, info_t *info, cpArbiter *arbiter)
+/* Appends an impact record to the space's impacts array, if above threshold */
+    {
+    shape_t *a, *b;
+    double *rec;
+    vec_t j = cpArbiterTotalImpulse(arbiter);
+    if(cpvlengthsq(j) < info->threshold*info->threshold) return;
+    cpArbiterGetShapes(arbiter, &a, &b);
+    rec = newrecord(L, info->hits);
+    rec[0] = a->hashid;
+    rec[1] = b->hashid;
+    rec[2] = cpArbiterIsFirstContact(arbiter);
+    rec[3] = j.x;
+    rec[4] = j.y;
+    rec[5] = cpArbiterTotalKE(arbiter);
+    }
+
+/*------------------------------------------------------------------------------*
+ | Sticky mode                                                                  |
+ *------------------------------------------------------------------------------*/
+
+/* This is a C port of the sticky demo (22-sticky.lua) callbacks. Each joint created by
+ * the handler has a record owned by the handler, kept in a set keyed by the pair of stuck
+ * shapes (not in the arbiter's user data, because arbiters may be recycled by Chipmunk
+ * without a separate callback, e.g. when a body is removed). Joints that are not surfaced
+ * are not visible to Lua (e.g. space:each_constraint() skips them). The records of surfaced
+ * joints hold a reference to their userdata, so that the ud is not collected and its
+ * 'Valid' mark tells reliably whether the joint was freed by the script, even if a new
+ * constraint was allocated at the same address in the meanwhile. */
+
+struct stick_s {
+    shape_t *key[2]; /* the pair of stuck shapes, ordered by address */
+    constraint_t *joint;
+    ud_t *ud; /* the joint's ud, if surfaced, or NULL */
+    int ref; /* reference to the joint's userdata, if surfaced */
+};
+
+static void stickkey(cpArbiter *arbiter, shape_t *key[2])
+    {
+    shape_t *a, *b;
+    cpArbiterGetShapes(arbiter, &a, &b);
+    key[0] = (uintptr_t)a < (uintptr_t)b ? a : b;
+    key[1] = (uintptr_t)a < (uintptr_t)b ? b : a;
+    }
+
+#define STICK_HASH(key) CP_HASH_PAIR((key)[0], (key)[1])
+
+static cpBool stickeql(const void *ptr, const void *elt)
+    {
+    shape_t * const *key = (shape_t* const*)ptr;
+    const stick_t *stick = (const stick_t*)elt;
+    return key[0] == stick->key[0] && key[1] == stick->key[1];
+    }
+
+static void FreeStick(space_t *space, void *key, void *data)
+    {
+    lua_State *L = spacectx(space)->L;
+    stick_t *stick = (stick_t*)key;
+    space_t *joint_space;
+    (void)data;
+    if(stick->ud)
+        {
+        if(IsValid(stick->ud)) stick->ud->destructor(L, stick->ud);
+        luaL_unref(L, LUA_REGISTRYINDEX, stick->ref);
+        }
+    else
+        {
+        joint_space = cpConstraintGetSpace(stick->joint);
+        if(joint_space) cpSpaceRemoveConstraint(joint_space, stick->joint);
+        cpConstraintFree(stick->joint);
+        }
+    Free(L, stick);
+    }
+
+static void AddStickyJoint(space_t *space, void *key, void *data)
+    { cpSpaceAddConstraint(space, (constraint_t*)key); (void)data; }
+
+static void releasestick(info_t *info, stick_t *stick, space_t *space)
+/* Removes the record from the handler's set, and destroys the joint and the record */
+    {
+    cpHashSetRemove(info->sticks, STICK_HASH(stick->key), stick->key);
+    if(!stick->ud || IsValid(stick->ud))
+        /* The joint won't be removed until the step is done, so disable it meanwhile */
+        cpConstraintSetMaxForce(stick->joint, 0.0);
+    if(cpSpaceIsLocked(space))
+        cpSpaceAddPostStepCallback(space, FreeStick, stick, NULL);
+    else /* e.g. separate called by cpSpaceRemoveShape() */
+        FreeStick(space, stick, NULL);
+    }
+
+static stick_t *findstick(info_t *info, shape_t *key[2], space_t *space)
+/* Returns the record for the pair of shapes, or NULL if none (or if its joint was freed by the script) */
+    {
+    stick_t *stick;
+    if(!info->sticks) return NULL;
+    stick = (stick_t*)cpHashSetFind(info->sticks, STICK_HASH(key), key);
+    if(stick && stick->ud && !IsValid(stick->ud))
+        { releasestick(info, stick, space); return NULL; }
+    return stick;
+    }
+
+static void newstick(lua_State *L, info_t *info, shape_t *key[2], constraint_t *joint, space_t *space)
+    {
+    stick_t *stick = (stick_t*)Malloc(L, sizeof(stick_t));
+    stick->key[0] = key[0];
+    stick->key[1] = key[1];
+    stick->joint = joint;
+    stick->ref = LUA_NOREF;
+    if(info->sticky.surface)
+        {
+        newpivot_joint(L, joint);
+        stick->ud = userdata(L, joint);
+        stick->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    if(!info->sticks) info->sticks = cpHashSetNew(0, stickeql);
+    cpHashSetInsert(info->sticks, STICK_HASH(key), key, NULL, stick);
+    cpSpaceAddPostStepCallback(space, AddStickyJoint, joint, NULL);
+    }
+
+typedef struct {
+    int count;
+    stick_t **sticks;
+} release_t;
+
+static void collectstick(void *elt, void *data)
+    { release_t *r = (release_t*)data; r->sticks[r->count++] = (stick_t*)elt; }
+
+static void releasesticks(lua_State *L, info_t *info, space_t *space)
+/* Releases all the joints created by the handler */
+    {
+    int i;
+    release_t r;
+    if(!info->sticks || (r.count = cpHashSetCount(info->sticks)) == 0) return;
+    r.sticks = (stick_t**)Malloc(L, r.count*sizeof(stick_t*));
+    r.count = 0;
+    cpHashSetEach(info->sticks, collectstick, &r); /* the set can't be modified while iterating */
+    for(i = 0; i < r.count; i++) releasestick(info, r.sticks[i], space);
+    Free(L, r.sticks);
+    }
+
+void releasestickyjoints(lua_State *L, ud_t *space_ud)
+/* Releases the joints created by all the sticky handlers of the space (see space:clear()) */
+    {
+    ud_t *ud;
+    for(ud = space_ud->first_child; ud != NULL; ud = ud->next_sibling)
+        {
+        if(strcmp(ud->mt, COLLISION_HANDLER_MT) == 0 && IsValid(ud))
+            releasesticks(L, (info_t*)ud->info, (space_t*)space_ud->handle);
+        }
+    }
+
+static cpBool stickypresolve(lua_State *L, info_t *info, cpArbiter *arbiter, space_t *space)
+    {
+    int i;
+    double deepest = INFINITY;
+    body_t *a, *b;
+    constraint_t *joint;
+    stick_t *stick;
+    shape_t *key[2];
+    const sticky_t *sticky = &info->sticky;
+    cpContactPointSet set = cpArbiterGetContactPointSet(arbiter);
+    vec_t delta = cpvmult(set.normal, sticky->thickness);
+    /* Sink the contact points into the surface of each shape, so to let them overlap more */
+    for(i = 0; i < set.count; i++)
+        {
+        set.points[i].pointA = cpvsub(set.points[i].pointA, delta);
+        set.points[i].pointB = cpvadd(set.points[i].pointB, delta);
+        deepest = fmin(deepest, set.points[i].distance + 2.0*sticky->thickness);
+        }
+    cpArbiterSetContactPointSet(arbiter, &set);
+    cpArbiterGetBodies(arbiter, &a, &b);
+    stickkey(arbiter, key);
+    stick = findstick(info, key, space);
+    if(stick && sticky->break_distance > 0 &&
+        cpvdist(cpBodyLocalToWorld(cpConstraintGetBodyA(stick->joint), cpPivotJointGetAnchorA(stick->joint)),
+                cpBodyLocalToWorld(cpConstraintGetBodyB(stick->joint), cpPivotJointGetAnchorB(stick->joint)))
+                > sticky->break_distance)
+        {
+        releasestick(info, stick, space);
+        stick = NULL;
+        }
+    if(!stick && deepest <= 0.0 && set.count > 0)
+        {
+        /* Create a joint at the first contact point to stick the bodies together */
+        joint = cpPivotJointNew2(a, b, cpBodyWorldToLocal(a, set.points[0].pointA),
+                                       cpBodyWorldToLocal(b, set.points[0].pointB));
+        cpConstraintSetMaxForce(joint, sticky->max_force);
+        newstick(L, info, key, joint, space);
+        }
+    /* Ignore the collision for this step if the shapes don't overlap using the new distance */
+    return deepest <= 0.0;
+    }
+
+static void stickyseparate(info_t *info, cpArbiter *arbiter, space_t *space)
+    {
+    shape_t *key[2];
+    stick_t *stick;
+    stickkey(arbiter, key);
+    if((stick = findstick(info, key, space)) != NULL)
+        releasestick(info, stick, space);
+    }
+
+/* Lua callbacks are traced with the handler's collision types as args */
+#define handlerpcall(L, space, ud, name, nargs, nresults)                                   \
+    tracedpcall((L), (space), CALLBACK_HANDLER, (name),                                     \
+        (long long)(intptr_t)((collision_handler_t*)(ud)->handle)->typeA,                   \
+        (long long)(intptr_t)((collision_handler_t*)(ud)->handle)->typeB, (nargs), (nresults))
+
 static cpBool BeginFunc(cpArbiter *arbiter, space_t *space, cpDataPointer userData)
     {
     int rc;
     cpBool res;
-    lua_State *L = moonchipmunk_L;
+    lua_State *L = spacectx(space)->L;
     ud_t *ud = (ud_t*)userData;
+    info_t *info = (info_t*)ud->info;
     int top = lua_gettop(L);
+    int swapped;
+    const cell_t *cell = lookup(info, arbiter, &swapped);
+    if(cell)
+        {
+        if(cell->action == COLLISION_ACTION_IGNORE) return cpFalse;
+        if(cell->events & COLLISION_EVENT_BEGIN)
+            recordevent(L, info, COLLISION_EVENT_BEGIN, arbiter);
+        return cpTrue;
+        }
+    if(info->events & COLLISION_EVENT_BEGIN)
+        recordevent(L, info, COLLISION_EVENT_BEGIN, arbiter);
+    if(ud->ref1 == LUA_NOREF)
+        return info->beginFunc(arbiter, space, info->userData);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
     pusharbiter(L, arbiter);
     pushspace(L, space);
-    rc = lua_pcall(L, 2, 1, 0);
+    rc = handlerpcall(L, space, ud, "begin", 2, 1);
     invalidatearbiter(L, arbiter);
     if(rc != LUA_OK) { lua_error(L); return 0; }
     res = lua_toboolean(L, -1);
@@ -74,13 +507,29 @@ static cpBool PreSolveFunc(cpArbiter *arbiter, space_t *space, cpDataPointer use
     {
     int rc;
     cpBool res;
-    lua_State *L = moonchipmunk_L;
+    lua_State *L = spacectx(space)->L;
     ud_t *ud = (ud_t*)userData;
+    info_t *info = (info_t*)ud->info;
     int top = lua_gettop(L);
+    int swapped;
+    const cell_t *cell = lookup(info, arbiter, &swapped);
+    if(info->hasfluid)
+        applyfluid(L, &info->fluid, arbiter, space);
+    if(info->hassticky && !stickypresolve(L, info, arbiter, space))
+        return cpFalse;
+    if(cell)
+        {
+        if(cell->action == COLLISION_ACTION_SENSOR) return cpFalse;
+        return applycellrule(cell, swapped, arbiter);
+        }
+    if(info->nrules > 0 && !applyrules(info->rules, info->nrules, arbiter))
+        return cpFalse;
+    if(ud->ref2 == LUA_NOREF)
+        return info->preSolveFunc(arbiter, space, info->userData);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref2);
     pusharbiter(L, arbiter);
     pushspace(L, space);
-    rc = lua_pcall(L, 2, 1, 0);
+    rc = handlerpcall(L, space, ud, "pre solve", 2, 1);
     invalidatearbiter(L, arbiter);
     if(rc != LUA_OK) { lua_error(L); return 0; }
     res = lua_toboolean(L, -1);
@@ -91,13 +540,28 @@ static cpBool PreSolveFunc(cpArbiter *arbiter, space_t *space, cpDataPointer use
 static void PostSolveFunc(cpArbiter *arbiter, space_t *space, cpDataPointer userData)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
+    lua_State *L = spacectx(space)->L;
     ud_t *ud = (ud_t*)userData;
+    info_t *info = (info_t*)ud->info;
     int top = lua_gettop(L);
+    int swapped;
+    const cell_t *cell = lookup(info, arbiter, &swapped);
+    if(info->impacts)
+        recordimpact(L, info, arbiter);
+    if(cell)
+        {
+        if(cell->events & COLLISION_EVENT_POST_SOLVE)
+            recordevent(L, info, COLLISION_EVENT_POST_SOLVE, arbiter);
+        return;
+        }
+    if(info->events & COLLISION_EVENT_POST_SOLVE)
+        recordevent(L, info, COLLISION_EVENT_POST_SOLVE, arbiter);
+    if(ud->ref3 == LUA_NOREF)
+        { info->postSolveFunc(arbiter, space, info->userData); return; }
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref3);
     pusharbiter(L, arbiter);
     pushspace(L, space);
-    rc = lua_pcall(L, 2, 0, 0);
+    rc = handlerpcall(L, space, ud, "post solve", 2, 0);
     invalidatearbiter(L, arbiter);
     if(rc != LUA_OK) { lua_error(L); return; }
     lua_settop(L, top);
@@ -107,13 +571,28 @@ static void PostSolveFunc(cpArbiter *arbiter, space_t *space, cpDataPointer user
 static void SeparateFunc(cpArbiter *arbiter, space_t *space, cpDataPointer userData)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
+    lua_State *L = spacectx(space)->L;
     ud_t *ud = (ud_t*)userData;
+    info_t *info = (info_t*)ud->info;
     int top = lua_gettop(L);
+    int swapped;
+    const cell_t *cell = lookup(info, arbiter, &swapped);
+    if(info->hassticky)
+        stickyseparate(info, arbiter, space);
+    if(cell)
+        {
+        if(cell->events & COLLISION_EVENT_SEPARATE)
+            recordevent(L, info, COLLISION_EVENT_SEPARATE, arbiter);
+        return;
+        }
+    if(info->events & COLLISION_EVENT_SEPARATE)
+        recordevent(L, info, COLLISION_EVENT_SEPARATE, arbiter);
+    if(ud->ref4 == LUA_NOREF)
+        { info->separateFunc(arbiter, space, info->userData); return; }
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref4);
     pusharbiter(L, arbiter);
     pushspace(L, space);
-    rc = lua_pcall(L, 2, 0, 0);
+    rc = handlerpcall(L, space, ud, "separate", 2, 0);
     invalidatearbiter(L, arbiter);
     if(rc != LUA_OK)
         { lua_error(L); return; }
@@ -121,13 +600,45 @@ static void SeparateFunc(cpArbiter *arbiter, space_t *space, cpDataPointer userD
     return;
     }
 
+static void updatefuncs(collision_handler_t *handler, ud_t *ud)
+/* Sets the handler's callbacks to ours where needed, and to the original ones elsewhere */
+    {
+    info_t *info = (info_t*)ud->info;
+    if(info->matrix)
+        {
+        handler->beginFunc = BeginFunc;
+        handler->preSolveFunc = PreSolveFunc;
+        handler->postSolveFunc = PostSolveFunc;
+        handler->separateFunc = SeparateFunc;
+        return;
+        }
+    handler->beginFunc = (ud->ref1 != LUA_NOREF || (info->events & COLLISION_EVENT_BEGIN)) ?
+                BeginFunc : info->beginFunc;
+    handler->preSolveFunc = (ud->ref2 != LUA_NOREF || info->nrules > 0 || info->hasfluid ||
+                info->hassticky) ?
+                PreSolveFunc : info->preSolveFunc;
+    handler->postSolveFunc = (ud->ref3 != LUA_NOREF || info->impacts ||
+                (info->events & COLLISION_EVENT_POST_SOLVE)) ?
+                PostSolveFunc : info->postSolveFunc;
+    handler->separateFunc = (ud->ref4 != LUA_NOREF || info->hassticky ||
+                (info->events & COLLISION_EVENT_SEPARATE)) ?
+                SeparateFunc : info->separateFunc;
+    }
+
+int handlercallslua(collision_handler_t *handler)
+/* Returns 1 if any of the handler's callbacks is ours (they all may need Lua) */
+    {
+    return handler->beginFunc == BeginFunc || handler->preSolveFunc == PreSolveFunc ||
+            handler->postSolveFunc == PostSolveFunc || handler->separateFunc == SeparateFunc;
+    }
+
 static int SetBeginFunc(lua_State *L)
     {
     ud_t *ud;
     collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
     if(!lua_isfunction(L, 2)) return argerror(L, 2, ERR_FUNCTION);
     Reference(L, 2, ud->ref1);
-    handler->beginFunc = BeginFunc;
+    updatefuncs(handler, ud);
     return 0;
     }
 
@@ -137,7 +648,7 @@ static int SetPreSolveFunc(lua_State *L)
     collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
     if(!lua_isfunction(L, 2)) return argerror(L, 2, ERR_FUNCTION);
     Reference(L, 2, ud->ref2);
-    handler->preSolveFunc = PreSolveFunc;
+    updatefuncs(handler, ud);
     return 0;
     }
 
@@ -147,7 +658,7 @@ static int SetPostSolveFunc(lua_State *L)
     collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
     if(!lua_isfunction(L, 2)) return argerror(L, 2, ERR_FUNCTION);
     Reference(L, 2, ud->ref3);
-    handler->postSolveFunc = PostSolveFunc;
+    updatefuncs(handler, ud);
     return 0;
     }
 
@@ -157,15 +668,295 @@ static int SetSeparateFunc(lua_State *L)
     collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
     if(!lua_isfunction(L, 2)) return argerror(L, 2, ERR_FUNCTION);
     Reference(L, 2, ud->ref4);
-    handler->separateFunc = SeparateFunc;
+    updatefuncs(handler, ud);
+    return 0;
+    }
+
+static int SetRecordedEvents(lua_State *L)
+    {
+    ud_t *ud;
+    collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
+    info_t *info = (info_t*)ud->info;
+    info->events = checkflags(L, 2);
+    updatefuncs(handler, ud);
+    return 0;
+    }
+
+static int GetRecordedEvents(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkcollision_handler(L, 1, &ud);
+    pushflags(L, ((info_t*)ud->info)->events);
+    return 1;
+    }
+
+static int RecordImpacts(lua_State *L)
+    {
+    ud_t *ud;
+    collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
+    info_t *info = (info_t*)ud->info;
+    if(lua_isboolean(L, 2))
+        {
+        info->impacts = lua_toboolean(L, 2);
+        info->threshold = 0;
+        }
+    else
+        {
+        info->threshold = luaL_optnumber(L, 2, 0);
+        info->impacts = 1;
+        }
+    updatefuncs(handler, ud);
+    return 0;
+    }
+
+static int AddPreSolveRule(lua_State *L)
+    {
+    ud_t *ud;
+    collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
+    info_t *info = (info_t*)ud->info;
+    if(info->nrules >= MAX_RULES) return failure(L, ERR_OPERATION);
+    checkrule(L, 2, &info->rules[info->nrules]);
+    info->nrules++;
+    updatefuncs(handler, ud);
+    return 0;
+    }
+
+static int ClearPreSolveRules(lua_State *L)
+    {
+    ud_t *ud;
+    collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
+    ((info_t*)ud->info)->nrules = 0;
+    updatefuncs(handler, ud);
+    return 0;
+    }
+
+static int GetPreSolveRules(lua_State *L)
+    {
+    ud_t *ud;
+    int i;
+    info_t *info;
+    (void)checkcollision_handler(L, 1, &ud);
+    info = (info_t*)ud->info;
+    for(i = 0; i < info->nrules; i++)
+        pushpresolverule(L, info->rules[i].kind);
+    return info->nrules;
+    }
+
+static int SetFluid(lua_State *L)
+    {
+    ud_t *ud;
+    collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
+    info_t *info = (info_t*)ud->info;
+    if(lua_isnoneornil(L, 2))
+        info->hasfluid = 0;
+    else
+        {
+        double density = luaL_checknumber(L, 2);
+        double drag = luaL_checknumber(L, 3);
+        double angular_drag = luaL_optnumber(L, 4, drag);
+        if(density < 0) return argerror(L, 2, ERR_VALUE);
+        if(drag < 0) return argerror(L, 3, ERR_VALUE);
+        if(angular_drag < 0) return argerror(L, 4, ERR_VALUE);
+        info->fluid.density = density;
+        info->fluid.drag = drag;
+        info->fluid.angular_drag = angular_drag;
+        info->hasfluid = 1;
+        }
+    updatefuncs(handler, ud);
+    return 0;
+    }
+
+static int GetFluid(lua_State *L)
+    {
+    ud_t *ud;
+    info_t *info;
+    (void)checkcollision_handler(L, 1, &ud);
+    info = (info_t*)ud->info;
+    if(!info->hasfluid) return 0;
+    lua_pushnumber(L, info->fluid.density);
+    lua_pushnumber(L, info->fluid.drag);
+    lua_pushnumber(L, info->fluid.angular_drag);
+    return 3;
+    }
+
+static int SetSticky(lua_State *L)
+    {
+    ud_t *ud;
+    collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
+    info_t *info = (info_t*)ud->info;
+    if(lua_isnoneornil(L, 2))
+        {
+        info->hassticky = 0;
+        releasesticks(L, info, (space_t*)ud->parent_ud->handle);
+        }
+    else
+        {
+        double thickness = luaL_checknumber(L, 2);
+        double max_force = luaL_checknumber(L, 3);
+        double break_distance = luaL_optnumber(L, 4, 0);
+        int surface = optboolean(L, 5, 0);
+        if(thickness < 0) return argerror(L, 2, ERR_VALUE);
+        if(max_force < 0) return argerror(L, 3, ERR_VALUE);
+        if(break_distance < 0) return argerror(L, 4, ERR_VALUE);
+        info->sticky.thickness = thickness;
+        info->sticky.max_force = max_force;
+        info->sticky.break_distance = break_distance;
+        info->sticky.surface = surface;
+        info->hassticky = 1;
+        }
+    updatefuncs(handler, ud);
+    return 0;
+    }
+
+static int GetSticky(lua_State *L)
+    {
+    ud_t *ud;
+    info_t *info;
+    (void)checkcollision_handler(L, 1, &ud);
+    info = (info_t*)ud->info;
+    if(!info->hassticky) return 0;
+    lua_pushnumber(L, info->sticky.thickness);
+    lua_pushnumber(L, info->sticky.max_force);
+    lua_pushnumber(L, info->sticky.break_distance);
+    lua_pushboolean(L, info->sticky.surface);
+    return 4;
+    }
+
+static int SetCollisionMatrix(lua_State *L)
+    {
+    ud_t *ud;
+    collision_handler_t *handler = checkcollision_handler(L, 1, &ud);
+    info_t *info = (info_t*)ud->info;
+    lua_Integer ntypes = luaL_checkinteger(L, 2);
+    if(ntypes < 0 || ntypes > 1024) return argerror(L, 2, ERR_RANGE);
+    if(info->matrix) { Free(L, info->matrix); info->matrix = NULL; }
+    if(ntypes > 0)
+        {
+        /* Malloc() zeroes, i.e. all cells are COLLISION_ACTION_SCRIPT */
+        info->matrix = (matrix_t*)Malloc(L, sizeof(matrix_t) + (ntypes*ntypes - 1)*sizeof(cell_t));
+        info->matrix->ntypes = ntypes;
+        }
+    updatefuncs(handler, ud);
+    return 0;
+    }
+
+static int GetCollisionMatrix(lua_State *L)
+    {
+    ud_t *ud;
+    matrix_t *m;
+    (void)checkcollision_handler(L, 1, &ud);
+    m = ((info_t*)ud->info)->matrix;
+    lua_pushinteger(L, m ? m->ntypes : 0);
+    return 1;
+    }
+
+static cell_t *checkcell(lua_State *L, ud_t *ud, int *swapped)
+/* Checks the types at args 2 and 3, and returns the corresponding cell */
+    {
+    matrix_t *m = ((info_t*)ud->info)->matrix;
+    lua_Integer a = luaL_checkinteger(L, 2);
+    lua_Integer b = luaL_checkinteger(L, 3);
+    if(!m) { failure(L, ERR_OPERATION); return NULL; }
+    if(a < 0 || a >= m->ntypes) { argerror(L, 2, ERR_RANGE); return NULL; }
+    if(b < 0 || b >= m->ntypes) { argerror(L, 3, ERR_RANGE); return NULL; }
+    *swapped = a > b;
+    return *swapped ? CELL(m, b, a) : CELL(m, a, b);
+    }
+
+static int SetCollisionCell(lua_State *L)
+    {
+    ud_t *ud;
+    int swapped;
+    cell_t *cell;
+    (void)checkcollision_handler(L, 1, &ud);
+    cell = checkcell(L, ud, &swapped);
+    cell->action = checkcollisionaction(L, 4);
+    cell->events = cell->action == COLLISION_ACTION_IGNORE ? 0 : optflags(L, 5, 0);
+    cell->hasrule = !lua_isnoneornil(L, 6);
+    if(cell->hasrule)
+        {
+        checkrule(L, 6, &cell->rule);
+        if(swapped) cell->rule.v = cpvneg(cell->rule.v); /* store it in the (min, max) order */
+        }
+    return 0;
+    }
+
+static int GetCollisionCell(lua_State *L)
+    {
+    ud_t *ud;
+    int swapped;
+    cell_t *cell;
+    (void)checkcollision_handler(L, 1, &ud);
+    cell = checkcell(L, ud, &swapped);
+    pushcollisionaction(L, cell->action);
+    pushflags(L, cell->events);
+    if(!cell->hasrule) return 2;
+    pushpresolverule(L, cell->rule.kind);
+    return 3;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Space methods for recorded events                                            |
+ *------------------------------------------------------------------------------*/
+
+static const char *EventFields[] = { "event", "a", "b", "nx", "ny", "px", "py", "jx", "jy", "ke", NULL };
+
+static int SetEventBufferSize(lua_State *L)
+    {
+    ud_t *ud;
+    lua_Integer capacity;
+    (void)checkspace(L, 1, &ud);
+    capacity = luaL_checkinteger(L, 2);
+    if(capacity < 1) return argerror(L, 2, ERR_RANGE);
+    resizerecords(L, spaceevents(ud), capacity);
     return 0;
     }
 
+static int GetEventBufferSize(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkspace(L, 1, &ud);
+    lua_pushinteger(L, spaceevents(ud)->capacity);
+    return 1;
+    }
+
+static int DrainEvents(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkspace(L, 1, &ud);
+    return drainrecords(L, 2, spaceevents(ud), EventFields, 3);
+    }
+
+static const char *ImpactFields[] = { "a", "b", "first", "jx", "jy", "ke", NULL };
+
+static int DrainImpacts(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkspace(L, 1, &ud);
+    return drainrecords(L, 2, spaceimpacts(ud), ImpactFields, 3);
+    }
+
+static const struct luaL_Reg SpaceMethods[] =
+    {
+        { "drain_impacts", DrainImpacts },
+        { "set_event_buffer_size", SetEventBufferSize },
+        { "get_event_buffer_size", GetEventBufferSize },
+        { "drain_events", DrainEvents },
+        { NULL, NULL } /* sentinel */
+    };
 
 RAW_FUNC(collision_handler)
 PARENT_FUNC(collision_handler)
 DESTROY_FUNC(collision_handler)
 
+static space_t *handlerspace(collision_handler_t *handler)
+    {
+    ud_t *ud = (ud_t*)handler->userData;
+    return ud->parent_ud ? (space_t*)ud->parent_ud->handle : NULL;
+    }
+
+GC_FUNC(collision_handler, handlerspace)
+
 static const struct luaL_Reg Methods[] = 
     {
         { "raw", Raw },
@@ -176,12 +967,26 @@ static const struct luaL_Reg Methods[] =
         { "set_pre_solve_func", SetPreSolveFunc },
         { "set_post_solve_func", SetPostSolveFunc },
         { "set_separate_func", SetSeparateFunc },
+        { "set_recorded_events", SetRecordedEvents },
+        { "get_recorded_events", GetRecordedEvents },
+        { "record_impacts", RecordImpacts },
+        { "add_pre_solve_rule", AddPreSolveRule },
+        { "clear_pre_solve_rules", ClearPreSolveRules },
+        { "get_pre_solve_rules", GetPreSolveRules },
+        { "set_collision_matrix", SetCollisionMatrix },
+        { "get_collision_matrix", GetCollisionMatrix },
+        { "set_collision_cell", SetCollisionCell },
+        { "get_collision_cell", GetCollisionCell },
+        { "set_fluid", SetFluid },
+        { "get_fluid", GetFluid },
+        { "set_sticky", SetSticky },
+        { "get_sticky", GetSticky },
         { NULL, NULL } /* sentinel */
     };
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -194,6 +999,7 @@ static const struct luaL_Reg Functions[] =
 void moonchipmunk_open_collision_handler(lua_State *L)
     {
     udata_define(L, COLLISION_HANDLER_MT, Methods, MetaMethods);
+    udata_addmethods(L, SPACE_MT, SpaceMethods);
     luaL_setfuncs(L, Functions, 0);
     }
 
@@ -25,11 +25,33 @@
 
 #include "internal.h"
 
-int candestroyconstraint(constraint_t *constraint, ud_t *ud)
+/* Constraints with a break force, or with a Lua post-solve callback, have this info
+ * both in ud->info and as Chipmunk user data, so that the post-solve callback needs
+ * no lookup when it has only to check the break force. */
+typedef struct {
+    double break_force; /* 0 = unbreakable */
+    int postsolve; /* 1 if ud->ref2 is set */
+} info_t;
+
+static info_t *getinfo(lua_State *L, constraint_t *constraint, ud_t *ud)
+    {
+    info_t *info = (info_t*)ud->info;
+    if(!info)
+        {
+        info = (info_t*)Malloc(L, sizeof(info_t));
+        memset(info, 0, sizeof(info_t));
+        ud->info = info;
+        cpConstraintSetUserData(constraint, info);
+        }
+    return info;
+    }
+
+int candestroyconstraint(lua_State *L, constraint_t *constraint, ud_t *ud)
     {
     space_t *space;
     if(!IsValid(ud)) return 0; /* already destroyed */
     space = cpConstraintGetSpace(constraint);
+    if(space && spacebusy(L, space)) return failure(L, ERR_OPERATION); /* async step in progress */
     if(space && cpSpaceIsLocked(space)) return 0; /* leave it to post step callbacks */
     return 1;
     }
@@ -147,14 +169,14 @@ static int GetCollideBodies(lua_State *L)
 
 static void PreSolveCallback(constraint_t *constraint, space_t *space) /* ud->ref1 */
     {
-#define L moonchipmunk_L
+#define L (spacectx(space)->L)
     int top = lua_gettop(L);
-    ud_t *ud = userdata(constraint);
+    ud_t *ud = userdata(L, constraint);
     if(!ud) { unexpected(L); return; } 
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
     pushconstraint(L, constraint);
     pushspace(L, space);
-    if(lua_pcall(L, 2, 0, 0) != LUA_OK)
+    if(timedpcall(L, space, CALLBACK_CONSTRAINT, 2, 0) != LUA_OK)
         { lua_error(L); return; }
     lua_settop(L, top);
     return;
@@ -188,34 +210,57 @@ static int GetPreSolveFunc(lua_State *L)
 
 static void PostSolveCallback(constraint_t *constraint, space_t *space) /* ud->ref2 */
     {
-#define L moonchipmunk_L
-    int top = lua_gettop(L);
-    ud_t *ud = userdata(constraint);
+#define L (spacectx(space)->L)
+    int top;
+    ud_t *ud;
+    info_t *info = (info_t*)cpConstraintGetUserData(constraint);
+    if(info->break_force > 0 &&
+        cpConstraintGetImpulse(constraint) > info->break_force*cpSpaceGetCurrentTimeStep(space))
+        breakconstraint(L, space, constraint);
+    if(!info->postsolve) return;
+    top = lua_gettop(L);
+    ud = userdata(L, constraint);
     if(!ud) { unexpected(L); return; } 
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref2);
     pushconstraint(L, constraint);
     pushspace(L, space);
-    if(lua_pcall(L, 2, 0, 0) != LUA_OK)
+    if(timedpcall(L, space, CALLBACK_CONSTRAINT, 2, 0) != LUA_OK)
         { lua_error(L); return; }
     lua_settop(L, top);
     return;
 #undef L
     }
 
+static void updatepostsolve(lua_State *L, constraint_t *constraint, ud_t *ud)
+/* Installs the post-solve callback if there is a Lua func or a break force, removes it otherwise */
+    {
+    info_t *info = getinfo(L, constraint, ud);
+    info->postsolve = ud->ref2 != LUA_NOREF;
+    cpConstraintSetPostSolveFunc(constraint, (info->postsolve || info->break_force > 0) ?
+                PostSolveCallback : NULL);
+    }
+
+int constraintcallslua(constraint_t *constraint)
+/* Returns 1 if the constraint has callbacks that need Lua (Lua funcs or a break force) */
+    {
+    return cpConstraintGetPreSolveFunc(constraint) == PreSolveCallback ||
+            cpConstraintGetPostSolveFunc(constraint) == PostSolveCallback;
+    }
+
 static int SetPostSolveFunc(lua_State *L)
     {
     ud_t *ud;
     constraint_t *constraint = checkconstraint(L, 1, &ud);
     if(lua_isnoneornil(L, 2)) /* remove callback */
         {
-        if(ud->ref2!=LUA_NOREF)
-            { cpConstraintSetPostSolveFunc(constraint, NULL); Unreference(L, ud->ref2); }
+        Unreference(L, ud->ref2);
+        updatepostsolve(L, constraint, ud);
         return 0;
         }
     if(!lua_isfunction(L, 2))
         return argerror(L, 2, ERR_FUNCTION);
     Reference(L, 2, ud->ref2);
-    cpConstraintSetPostSolveFunc(constraint, PostSolveCallback);
+    updatepostsolve(L, constraint, ud);
     return 0;
     }
 
@@ -227,9 +272,31 @@ static int GetPostSolveFunc(lua_State *L)
     return 1;
     }
 
+static int SetBreakForce(lua_State *L)
+    {
+    ud_t *ud;
+    constraint_t *constraint = checkconstraint(L, 1, &ud);
+    double force = luaL_optnumber(L, 2, 0);
+    if(force < 0) return argerror(L, 2, ERR_VALUE);
+    getinfo(L, constraint, ud)->break_force = force;
+    updatepostsolve(L, constraint, ud);
+    return 0;
+    }
+
+static int GetBreakForce(lua_State *L)
+    {
+    ud_t *ud;
+    info_t *info;
+    (void)checkconstraint(L, 1, &ud);
+    info = (info_t*)ud->info;
+    lua_pushnumber(L, info ? info->break_force : 0);
+    return 1;
+    }
+
 RAW_FUNC(constraint)
 PARENT_FUNC(constraint)
 DESTROY_FUNC(constraint)
+GC_FUNC(constraint, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -263,12 +330,14 @@ static const struct luaL_Reg Methods[] =
         { "get_pre_solve_func", GetPreSolveFunc },
         { "set_post_solve_func", SetPostSolveFunc },
         { "get_post_solve_func", GetPostSolveFunc },
+        { "set_break_force", SetBreakForce },
+        { "get_break_force", GetBreakForce },
         { NULL, NULL } /* sentinel */
     };
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -283,7 +352,3 @@ void moonchipmunk_open_constraint(lua_State *L)
     luaL_setfuncs(L, Functions, 0);
     }
 
-#if 0
-//cpDataPointer cpConstraintGetUserData(const constraint_t *constraint);
-//void cpConstraintSetUserData(constraint_t *constraint, cpDataPointer userData);
-#endif
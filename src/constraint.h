@@ -79,7 +79,7 @@ static int Func(lua_State *L)                                       \
     {                                                               \
     constraint_t *constraint = check##what(L, 1, NULL);             \
     vec_t val = func(constraint);                                   \
-    pushvec(L, &val);                                               \
+    pushvecout(L, 2, &val);                                         \
     return 1;                                                       \
     }
 
@@ -29,7 +29,7 @@
 static int freedamped_rotary_spring(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "damped_rotary_spring")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -64,10 +64,10 @@ GETDOUBLE(GetDamping, cpDampedRotarySpringGetDamping, damped_rotary_spring)
 
 static double TorqueCallback(struct constraint_t *constraint, double relativeAngle) /* ud->ref3 */
     {
-#define L moonchipmunk_L
+#define L (spacectx(cpConstraintGetSpace(constraint))->L)
     double result;
     int top = lua_gettop(L);
-    ud_t *ud = userdata(constraint);
+    ud_t *ud = userdata(L, constraint);
     if(!ud) { unexpected(L); return 0.0f; } 
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref3);
     pushconstraint(L, constraint);
@@ -106,6 +106,7 @@ static int GetTorqueFunc(lua_State *L)
     }
 
 DESTROY_FUNC(damped_rotary_spring)
+GC_FUNC(damped_rotary_spring, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -123,7 +124,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
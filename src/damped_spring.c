@@ -29,7 +29,7 @@
 static int freedamped_spring(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "damped_spring")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -73,10 +73,10 @@ GETDOUBLE(GetDamping, cpDampedSpringGetDamping, damped_spring)
 
 static double ForceCallback(constraint_t *constraint, double dist) /* ud->ref3 */
     {
-#define L moonchipmunk_L
+#define L (spacectx(cpConstraintGetSpace(constraint))->L)
     double result;
     int top = lua_gettop(L);
-    ud_t *ud = userdata(constraint);
+    ud_t *ud = userdata(L, constraint);
     if(!ud) { unexpected(L); return 0.0f; } 
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref3);
     pushconstraint(L, constraint);
@@ -115,6 +115,7 @@ static int GetSpringForceFunc(lua_State *L)
     }
 
 DESTROY_FUNC(damped_spring)
+GC_FUNC(damped_spring, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -136,7 +137,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
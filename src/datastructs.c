@@ -25,19 +25,23 @@
 
 #include "internal.h"
 
+/* References to the MoonGLMATH functions used to convert pushed values to glmath objects
+ * are kept in the per-state context (ctx->tovec2, etc). */
 #define GLMATH_COMPAT (tovec2 != LUA_NOREF)
-/* References to the MoonGLMATH functions used to convert pushed values to glmath objects. */
-static int tovec2 = LUA_NOREF;
-static int tovec4 = LUA_NOREF;
-static int tomat2x3 = LUA_NOREF;
-static int tobox2 = LUA_NOREF;
-
-
-int isglmathcompat(void)
-    { return GLMATH_COMPAT; }
+#define tovec2 ctx->tovec2
+#define tovec4 ctx->tovec4
+#define tomat2x3 ctx->tomat2x3
+#define tobox2 ctx->tobox2
+
+int isglmathcompat(lua_State *L)
+    { 
+    ctx_t *ctx = getctx(L);
+    return GLMATH_COMPAT; 
+    }
 
 int glmathcompat(lua_State *L, int on)
     {
+    ctx_t *ctx = getctx(L);
     if(on)
         {
         if(GLMATH_COMPAT) return 0; /* already enabled */
@@ -72,6 +76,13 @@ int testvec(lua_State *L, int arg, vec_t *dst)
         case LUA_TNONE:
         case LUA_TNIL:  return ERR_NOTPRESENT;
         case LUA_TTABLE: break;
+        case LUA_TUSERDATA:
+            {
+            vec_t *v = (vec_t*)luaL_testudata(L, arg, VEC_MT);
+            if(!v) return ERR_TABLE;
+            *dst = *v;
+            return 0;
+            }
         default: return ERR_TABLE;
         }
 #define POP if(!isnum) { lua_pop(L, 1); return ERR_VALUE; } lua_pop(L, 1);
@@ -97,6 +108,8 @@ int checkvec(lua_State *L, int arg, vec_t *dst)
 
 void pushvec(lua_State *L, const vec_t *val)
     {
+    ctx_t *ctx = getctx(L);
+    if(ctx->vec_mode == VEC_MODE_USERDATA) { newvec(L, val); return; }
     if(GLMATH_COMPAT) lua_rawgeti(L, LUA_REGISTRYINDEX, tovec2);
     lua_newtable(L);
     lua_pushnumber(L, val->x); lua_rawseti(L, -2, 1);
@@ -104,6 +117,28 @@ void pushvec(lua_State *L, const vec_t *val)
     if(GLMATH_COMPAT && lua_pcall(L,1,1,0)!=LUA_OK) { unexpected(L); return; }
     }
 
+void pushvecout(lua_State *L, int arg, const vec_t *val)
+/* Pushes val, storing it in the vec at arg if present (the optional 'out' argument),
+ * instead of creating a new one. */
+    {
+    vec_t *v;
+    switch(lua_type(L, arg))
+        {
+        case LUA_TNONE:
+        case LUA_TNIL: pushvec(L, val); return;
+        case LUA_TTABLE:
+            lua_pushnumber(L, val->x); lua_rawseti(L, arg, 1);
+            lua_pushnumber(L, val->y); lua_rawseti(L, arg, 2);
+            break;
+        case LUA_TUSERDATA:
+            if(!(v = (vec_t*)luaL_testudata(L, arg, VEC_MT))) { argerror(L, arg, ERR_TYPE); return; }
+            *v = *val;
+            break;
+        default: argerror(L, arg, ERR_TABLE); return;
+        }
+    lua_pushvalue(L, arg);
+    }
+
 vec_t *checkveclist(lua_State *L, int arg, int *countp, int *err)
 /* Check if the value at arg is a table of vecs and returns the corresponding
  * array of vec_t, stroing the size in *countp. The array is Malloc()'d and the
@@ -147,6 +182,219 @@ void pushveclist(lua_State *L, const vec_t *vecs , int count)
         }
     }
 
+/* vec userdata ---------------------------------------------------*/
+
+/* A compact alternative to the {x, y} table, made of a single userdata containing
+ * a vec_t. It can be used wherever a vec is expected, supports v.x, v.y, v[1], v[2]
+ * and the usual arithmetic operators, and it can be passed as 'out' argument to
+ * the getters that support it, to be overwritten instead of creating a new vec.
+ */
+
+void newvec(lua_State *L, const vec_t *val)
+    {
+    vec_t *v = (vec_t*)lua_newuserdata(L, sizeof(vec_t));
+    *v = *val;
+    luaL_setmetatable(L, VEC_MT);
+    }
+
+#define checkvecud(L, arg) (vec_t*)luaL_checkudata((L), (arg), VEC_MT)
+
+static int Vec(lua_State *L)
+    {
+    vec_t v;
+    v.x = luaL_optnumber(L, 1, 0);
+    v.y = luaL_optnumber(L, 2, 0);
+    newvec(L, &v);
+    return 1;
+    }
+
+static int VecMode(lua_State *L)
+    {
+    ctx_t *ctx = getctx(L);
+    if(!lua_isnoneornil(L, 1))
+        ctx->vec_mode = checkvecmode(L, 1);
+    pushvecmode(L, ctx->vec_mode);
+    return 1;
+    }
+
+static double *vecfield(lua_State *L, vec_t *v, int arg)
+/* returns a pointer to the field of v indexed by the key at arg, or NULL */
+    {
+    const char *s;
+    int isnum;
+    lua_Integer i;
+    if(lua_type(L, arg) == LUA_TSTRING)
+        {
+        s = lua_tostring(L, arg);
+        if(s[0]!='\0' && s[1]=='\0')
+            {
+            if(s[0]=='x') return &v->x;
+            if(s[0]=='y') return &v->y;
+            }
+        return NULL;
+        }
+    i = lua_tointegerx(L, arg, &isnum);
+    if(isnum && i==1) return &v->x;
+    if(isnum && i==2) return &v->y;
+    return NULL;
+    }
+
+static int VecIndex(lua_State *L)
+    {
+    vec_t *v = checkvecud(L, 1);
+    double *field = vecfield(L, v, 2);
+    if(field) { lua_pushnumber(L, *field); return 1; }
+    /* method */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+    }
+
+static int VecNewIndex(lua_State *L)
+    {
+    vec_t *v = checkvecud(L, 1);
+    double *field = vecfield(L, v, 2);
+    if(!field) return argerror(L, 2, ERR_VALUE);
+    *field = luaL_checknumber(L, 3);
+    return 0;
+    }
+
+static int VecSet(lua_State *L)
+    {
+    vec_t *v = checkvecud(L, 1);
+    if(lua_isnumber(L, 2))
+        {
+        v->x = luaL_checknumber(L, 2);
+        v->y = luaL_checknumber(L, 3);
+        }
+    else
+        checkvec(L, 2, v);
+    lua_settop(L, 1);
+    return 1;
+    }
+
+static int VecUnpack(lua_State *L)
+    {
+    vec_t *v = checkvecud(L, 1);
+    lua_pushnumber(L, v->x);
+    lua_pushnumber(L, v->y);
+    return 2;
+    }
+
+static int VecToTable(lua_State *L)
+    {
+    vec_t *v = checkvecud(L, 1);
+    lua_newtable(L);
+    lua_pushnumber(L, v->x); lua_rawseti(L, -2, 1);
+    lua_pushnumber(L, v->y); lua_rawseti(L, -2, 2);
+    return 1;
+    }
+
+static int VecLen(lua_State *L)
+    {
+    (void)checkvecud(L, 1);
+    lua_pushinteger(L, 2);
+    return 1;
+    }
+
+static int VecToString(lua_State *L)
+    {
+    vec_t *v = checkvecud(L, 1);
+    lua_pushfstring(L, "{%f, %f}", v->x, v->y);
+    return 1;
+    }
+
+static int VecEq(lua_State *L)
+    {
+    vec_t a, b;
+    checkvec(L, 1, &a);
+    checkvec(L, 2, &b);
+    lua_pushboolean(L, cpveql(a, b));
+    return 1;
+    }
+
+#define F(Func, func) /* vec = a op b */    \
+static int Func(lua_State *L)               \
+    {                                       \
+    vec_t a, b, r;                          \
+    checkvec(L, 1, &a);                     \
+    checkvec(L, 2, &b);                     \
+    r = func(a, b);                         \
+    newvec(L, &r);                          \
+    return 1;                               \
+    }
+F(VecAdd, cpvadd)
+F(VecSub, cpvsub)
+#undef F
+
+static int VecMul(lua_State *L)
+    {
+    vec_t v, r;
+    if(lua_type(L, 1) == LUA_TNUMBER)
+        { checkvec(L, 2, &v); r = cpvmult(v, lua_tonumber(L, 1)); }
+    else
+        { checkvec(L, 1, &v); r = cpvmult(v, luaL_checknumber(L, 2)); }
+    newvec(L, &r);
+    return 1;
+    }
+
+static int VecDiv(lua_State *L)
+    {
+    vec_t v, r;
+    checkvec(L, 1, &v);
+    r = cpvmult(v, 1.0/luaL_checknumber(L, 2));
+    newvec(L, &r);
+    return 1;
+    }
+
+static int VecUnm(lua_State *L)
+    {
+    vec_t *v = checkvecud(L, 1);
+    vec_t r = cpvneg(*v);
+    newvec(L, &r);
+    return 1;
+    }
+
+static const struct luaL_Reg VecMethods[] = 
+    {
+        { "set", VecSet },
+        { "unpack", VecUnpack },
+        { "totable", VecToTable },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg VecMetaMethods[] = 
+    {
+        { "__newindex", VecNewIndex },
+        { "__len", VecLen },
+        { "__tostring", VecToString },
+        { "__eq", VecEq },
+        { "__add", VecAdd },
+        { "__sub", VecSub },
+        { "__mul", VecMul },
+        { "__div", VecDiv },
+        { "__unm", VecUnm },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "vec", Vec },
+        { "vec_mode", VecMode },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonchipmunk_open_datastructs(lua_State *L)
+    {
+    luaL_newmetatable(L, VEC_MT);
+    luaL_setfuncs(L, VecMetaMethods, 0);
+    luaL_newlib(L, VecMethods);
+    lua_pushcclosure(L, VecIndex, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
 /* mat_t ----------------------------------------------------------*/
 
 /* In Lua: {{ a, c, tx },
@@ -200,6 +448,7 @@ int checkmat(lua_State *L, int arg, mat_t *dst)
 
 void pushmat(lua_State *L, mat_t *val)
     {
+    ctx_t *ctx = getctx(L);
     if(GLMATH_COMPAT) lua_rawgeti(L, LUA_REGISTRYINDEX, tomat2x3);
     lua_newtable(L);
     /* row 1 */
@@ -261,6 +510,7 @@ int checkbb(lua_State *L, int arg, bb_t *dst)
 
 void pushbb(lua_State *L, bb_t *val)
     {
+    ctx_t *ctx = getctx(L);
     if(GLMATH_COMPAT) lua_rawgeti(L, LUA_REGISTRYINDEX, tobox2);
     lua_newtable(L);
     lua_pushnumber(L, val->l); lua_rawseti(L, -2, 1);
@@ -308,6 +558,7 @@ int checkcolor(lua_State *L, int arg, color_t *dst)
 
 void pushcolor(lua_State *L, color_t *val)
     {
+    ctx_t *ctx = getctx(L);
     if(GLMATH_COMPAT) lua_rawgeti(L, LUA_REGISTRYINDEX, tovec4);
     lua_newtable(L);
     lua_pushnumber(L, val->r); lua_rawseti(L, -2, 1);
@@ -322,7 +573,7 @@ void pushcolor(lua_State *L, color_t *val)
 void pushpointqueryinfo(lua_State *L, cpPointQueryInfo *val)
     {
     if(val->shape==NULL) { lua_pushnil(L); return; }
-    if(userdata(val->shape)==NULL) unexpected(L); // unknown object
+    if(userdata(L, val->shape)==NULL) unexpected(L); // unknown object
     lua_newtable(L);
     pushshape(L, val->shape); lua_setfield(L, -2, "shape");
     pushvec(L, &val->point); lua_setfield(L, -2, "point");
@@ -335,7 +586,7 @@ void pushpointqueryinfo(lua_State *L, cpPointQueryInfo *val)
 void pushsegmentqueryinfo(lua_State *L, cpSegmentQueryInfo *val)
     {
     if(val->shape==NULL) { lua_pushnil(L); return; }
-    if(userdata(val->shape)==NULL) unexpected(L); // unknown object?
+    if(userdata(L, val->shape)==NULL) unexpected(L); // unknown object?
     lua_newtable(L);
     pushshape(L, val->shape); lua_setfield(L, -2, "shape");
     pushvec(L, &val->point); lua_setfield(L, -2, "point");
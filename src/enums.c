@@ -29,118 +29,67 @@
  | Code<->string map for enumerations                                           |
  *------------------------------------------------------------------------------*/
 
+/* The code<->string mappings are constant, so they are kept in a static table
+ * shared by all the Lua states (the domains are small, so a linear search is
+ * good enough).
+ */
+
 /* code <-> string record */
 #define rec_t struct rec_s
 struct rec_s {
-    RB_ENTRY(rec_s) CodeEntry;
-    RB_ENTRY(rec_s) StringEntry;
     int domain;
-    int code;  /* (domain, code) = search key in code tree */
-    char     *str;  /* (domain, str) = search key in string tree */
+    int code;
+    const char *str;
 };
 
-/* compare functions */
-static int cmp_code(rec_t *rec1, rec_t *rec2) 
-    { 
-    if(rec1->domain != rec2->domain)
-        return (rec1->domain < rec2->domain ? -1 : rec1->domain > rec2->domain);
-    return (rec1->code < rec2->code ? -1 : rec1->code > rec2->code);
-    } 
-
-static int cmp_str(rec_t *rec1, rec_t *rec2) 
-    { 
-    if(rec1->domain != rec2->domain)
-        return (rec1->domain < rec2->domain ? -1 : rec1->domain > rec2->domain);
-    return strcmp(rec1->str, rec2->str);
-    } 
-
-static RB_HEAD(CodeTree, rec_s) CodeHead = RB_INITIALIZER(&CodeHead);
-RB_PROTOTYPE_STATIC(CodeTree, rec_s, CodeEntry, cmp_code) 
-RB_GENERATE_STATIC(CodeTree, rec_s, CodeEntry, cmp_code) 
-
-static RB_HEAD(StringTree, rec_s) StringHead = RB_INITIALIZER(&StringHead);
-RB_PROTOTYPE_STATIC(StringTree, rec_s, StringEntry, cmp_str) 
-RB_GENERATE_STATIC(StringTree, rec_s, StringEntry, cmp_str) 
- 
-static rec_t *code_remove(rec_t *rec) 
-    { return RB_REMOVE(CodeTree, &CodeHead, rec); }
-static rec_t *code_insert(rec_t *rec) 
-    { return RB_INSERT(CodeTree, &CodeHead, rec); }
-static rec_t *code_search(int domain, int code) 
-    { rec_t tmp; tmp.domain = domain; tmp.code = code; return RB_FIND(CodeTree, &CodeHead, &tmp); }
-static rec_t *code_first(int domain, int code) 
-    { rec_t tmp; tmp.domain = domain; tmp.code = code; return RB_NFIND(CodeTree, &CodeHead, &tmp); }
-static rec_t *code_next(rec_t *rec)
-    { return RB_NEXT(CodeTree, &CodeHead, rec); }
-#if 0
-static rec_t *code_prev(rec_t *rec)
-    { return RB_PREV(CodeTree, &CodeHead, rec); }
-static rec_t *code_min(void)
-    { return RB_MIN(CodeTree, &CodeHead); }
-static rec_t *code_max(void)
-    { return RB_MAX(CodeTree, &CodeHead); }
-static rec_t *code_root(void)
-    { return RB_ROOT(&CodeHead); }
-#endif
- 
-static rec_t *str_remove(rec_t *rec) 
-    { return RB_REMOVE(StringTree, &StringHead, rec); }
-static rec_t *str_insert(rec_t *rec) 
-    { return RB_INSERT(StringTree, &StringHead, rec); }
-static rec_t *str_search(int domain, const char* str) 
-    { rec_t tmp; tmp.domain = domain; tmp.str = (char*)str; return RB_FIND(StringTree, &StringHead, &tmp); }
-#if 0
-static rec_t *str_first(int domain, const char* str ) 
-    { rec_t tmp; tmp.domain = domain; tmp.str = str; return RB_NFIND(StringTree, &StringHead, &tmp); }
-static rec_t *str_next(rec_t *rec)
-    { return RB_NEXT(StringTree, &StringHead, rec); }
-static rec_t *str_prev(rec_t *rec)
-    { return RB_PREV(StringTree, &StringHead, rec); }
-static rec_t *str_min(void)
-    { return RB_MIN(StringTree, &StringHead); }
-static rec_t *str_max(void)
-    { return RB_MAX(StringTree, &StringHead); }
-static rec_t *str_root(void)
-    { return RB_ROOT(&StringHead); }
-#endif
-
-
-static int enums_new(lua_State *L, int domain, int code, const char *str)
-    {
-    rec_t *rec;
-    if((rec = (rec_t*)Malloc(L, sizeof(rec_t))) == NULL) 
-        return luaL_error(L, errstring(ERR_MEMORY));
-
-    memset(rec, 0, sizeof(rec_t));
-    rec->domain = domain;
-    rec->code = code;
-    rec->str = Strdup(L, str);
-    if(code_search(domain, code) || str_search(domain, str))
-        { 
-        Free(L, rec->str);
-        Free(L, rec); 
-        return unexpected(L); /* duplicate value */
-        }
-    code_insert(rec);
-    str_insert(rec);
-    return 0;
-    }
+static const rec_t Records[] = {
+    /* DOMAIN_BODY_TYPE (cpBodyType) */
+    { DOMAIN_BODY_TYPE, CP_BODY_TYPE_DYNAMIC, "dynamic" },
+    { DOMAIN_BODY_TYPE, CP_BODY_TYPE_KINEMATIC, "kinematic" },
+    { DOMAIN_BODY_TYPE, CP_BODY_TYPE_STATIC, "static" },
+    /* DOMAIN_VEC_MODE */
+    { DOMAIN_VEC_MODE, VEC_MODE_TABLE, "table" },
+    { DOMAIN_VEC_MODE, VEC_MODE_USERDATA, "userdata" },
+    /* DOMAIN_FORMAT */
+    { DOMAIN_FORMAT, FORMAT_FLOAT, "float" },
+    { DOMAIN_FORMAT, FORMAT_DOUBLE, "double" },
+    /* DOMAIN_LAYOUT */
+    { DOMAIN_LAYOUT, LAYOUT_AOS, "aos" },
+    { DOMAIN_LAYOUT, LAYOUT_SOA, "soa" },
+    /* DOMAIN_PRE_SOLVE_RULE */
+    { DOMAIN_PRE_SOLVE_RULE, RULE_IGNORE_IF_NORMAL, "ignore if normal" },
+    { DOMAIN_PRE_SOLVE_RULE, RULE_IGNORE_AFTER_FIRST_CONTACT, "ignore after first contact" },
+    { DOMAIN_PRE_SOLVE_RULE, RULE_FRICTION, "friction" },
+    { DOMAIN_PRE_SOLVE_RULE, RULE_ELASTICITY, "elasticity" },
+    { DOMAIN_PRE_SOLVE_RULE, RULE_SURFACE_VELOCITY, "surface velocity" },
+    /* DOMAIN_COLLISION_ACTION */
+    { DOMAIN_COLLISION_ACTION, COLLISION_ACTION_SCRIPT, "script" },
+    { DOMAIN_COLLISION_ACTION, COLLISION_ACTION_COLLIDE, "collide" },
+    { DOMAIN_COLLISION_ACTION, COLLISION_ACTION_IGNORE, "ignore" },
+    { DOMAIN_COLLISION_ACTION, COLLISION_ACTION_SENSOR, "sensor" },
+    /* DOMAIN_FORCE_FIELD */
+    { DOMAIN_FORCE_FIELD, FORCE_FIELD_GRAVITY_SCALE, "gravity scale" },
+    { DOMAIN_FORCE_FIELD, FORCE_FIELD_POINT_GRAVITY, "point gravity" },
+    { DOMAIN_FORCE_FIELD, FORCE_FIELD_WIND, "wind" },
+    { DOMAIN_FORCE_FIELD, FORCE_FIELD_LINEAR_DRAG, "linear drag" },
+    { DOMAIN_FORCE_FIELD, FORCE_FIELD_QUADRATIC_DRAG, "quadratic drag" },
+    { 0, 0, NULL } /* sentinel */
+};
 
-static void enums_free(lua_State *L, rec_t* rec)
+static const rec_t *code_search(int domain, int code) 
     {
-    if(code_search(rec->domain, rec->code) == rec)
-        code_remove(rec);
-    if(str_search(rec->domain, rec->str) == rec)
-        str_remove(rec);
-    Free(L, rec->str);
-    Free(L, rec);   
+    const rec_t *rec;
+    for(rec = Records; rec->str != NULL; rec++)
+        if((rec->domain == domain) && (rec->code == code)) return rec;
+    return NULL;
     }
 
-void enums_free_all(lua_State *L)
+static const rec_t *str_search(int domain, const char* str) 
     {
-    rec_t *rec;
-    while((rec = code_first(0, 0)))
-        enums_free(L, rec);
+    const rec_t *rec;
+    for(rec = Records; rec->str != NULL; rec++)
+        if((rec->domain == domain) && (strcmp(rec->str, str) == 0)) return rec;
+    return NULL;
     }
 
 #if 0
@@ -155,7 +104,7 @@ int enums_code(int domain, const char *str, int* found)
 
 const char* enums_string(int domain, int code)
     {
-    rec_t *rec = code_search(domain, code);
+    const rec_t *rec = code_search(domain, code);
     if(!rec)
         return NULL;
     return rec->str;
@@ -165,7 +114,7 @@ const char* enums_string(int domain, int code)
 
 int enums_test(lua_State *L, int domain, int arg, int *err)
     {
-    rec_t *rec;
+    const rec_t *rec;
     const char *s = luaL_optstring(L, arg, NULL);
     if(!s) { *err = ERR_NOTPRESENT; return 0; }
     rec = str_search(domain, s);
@@ -176,7 +125,7 @@ int enums_test(lua_State *L, int domain, int arg, int *err)
 
 int enums_opt(lua_State *L, int domain, int arg, int defval)
     {
-    rec_t *rec;
+    const rec_t *rec;
     const char *s = luaL_optstring(L, arg, NULL);
     if(!s) { return defval; }
     rec = str_search(domain, s);
@@ -186,7 +135,7 @@ int enums_opt(lua_State *L, int domain, int arg, int defval)
 
 int enums_check(lua_State *L, int domain, int arg)
     {
-    rec_t *rec;
+    const rec_t *rec;
     const char *s = luaL_checkstring(L, arg);
     rec = str_search(domain, s);
     if(!rec) return luaL_argerror(L, arg, badvalue(L, s));
@@ -195,7 +144,7 @@ int enums_check(lua_State *L, int domain, int arg)
 
 int enums_push(lua_State *L, int domain, int code)
     {
-    rec_t *rec = code_search(domain, code);
+    const rec_t *rec = code_search(domain, code);
     if(!rec) return unexpected(L);
     lua_pushstring(L, rec->str);
     return 1;
@@ -204,19 +153,17 @@ int enums_push(lua_State *L, int domain, int code)
 int enums_values(lua_State *L, int domain)
     {
     int i;
-    rec_t *rec;
+    const rec_t *rec;
 
     lua_newtable(L);
     i = 1;
-    rec = code_first(domain, 0);
-    while(rec)
+    for(rec = Records; rec->str != NULL; rec++)
         {
         if(rec->domain == domain)
             {
             lua_pushstring(L, rec->str);
             lua_rawseti(L, -2, i++);
             }
-        rec = code_next(rec);
         }
 
     return 1;
@@ -270,6 +217,12 @@ static int Enum(lua_State *L)
     const char *s = luaL_checkstring(L, 1); 
 #define CASE(xxx) if(strcmp(s, ""#xxx) == 0) return values##xxx(L)
     CASE(bodytype);
+    CASE(vecmode);
+    CASE(format);
+    CASE(layout);
+    CASE(presolverule);
+    CASE(collisionaction);
+    CASE(forcefield);
 #undef CASE
     return 0;
     }
@@ -283,17 +236,6 @@ static const struct luaL_Reg Functions[] =
 
 void moonchipmunk_open_enums(lua_State *L)
     {
-    int domain;
-
     luaL_setfuncs(L, Functions, 0);
-
-    /* Add all the code<->string mappings */
-#define ADD(what, s) do { enums_new(L, domain, what, s); } while(0)
-    domain = DOMAIN_BODY_TYPE; /* cpBodyType */
-    ADD(CP_BODY_TYPE_DYNAMIC, "dynamic");
-    ADD(CP_BODY_TYPE_KINEMATIC, "kinematic");
-    ADD(CP_BODY_TYPE_STATIC, "static");
-
-#undef ADD
     }
 
@@ -27,8 +27,6 @@
 #define enumsDEFINED
 
 /* enums.c */
-#define enums_free_all moonchipmunk_enums_free_all
-void enums_free_all(lua_State *L);
 #define enums_test moonchipmunk_enums_test
 int enums_test(lua_State *L, int domain, int arg, int *err);
 #define enums_opt moonchipmunk_enums_opt
@@ -48,6 +46,42 @@ void enums_freelist(lua_State *L, int *list);
 /* Enum domains */
 #define DOMAIN_                         0
 #define DOMAIN_BODY_TYPE                1
+#define DOMAIN_VEC_MODE                 2
+#define DOMAIN_FORMAT                   3
+#define DOMAIN_LAYOUT                   4
+#define DOMAIN_PRE_SOLVE_RULE           5
+#define DOMAIN_COLLISION_ACTION         6
+#define DOMAIN_FORCE_FIELD              7
+
+/* Vector representations (see datastructs.c) */
+#define VEC_MODE_TABLE      0
+#define VEC_MODE_USERDATA   1
+
+/* Packed data (see packed.c) */
+#define FORMAT_FLOAT        0   /* 32-bit floats */
+#define FORMAT_DOUBLE       1   /* 64-bit floats */
+#define LAYOUT_AOS          0   /* array of structures (records) */
+#define LAYOUT_SOA          1   /* structure of arrays (one array per component) */
+
+/* Native pre-solve rules (see collision_handler.c) */
+#define RULE_IGNORE_IF_NORMAL           0
+#define RULE_IGNORE_AFTER_FIRST_CONTACT 1
+#define RULE_FRICTION                   2
+#define RULE_ELASTICITY                 3
+#define RULE_SURFACE_VELOCITY           4
+
+/* Collision matrix actions (see collision_handler.c) */
+#define COLLISION_ACTION_SCRIPT     0   /* as if there were no matrix */
+#define COLLISION_ACTION_COLLIDE    1
+#define COLLISION_ACTION_IGNORE     2
+#define COLLISION_ACTION_SENSOR     3
+
+/* Native force fields (see body.c) */
+#define FORCE_FIELD_GRAVITY_SCALE   0
+#define FORCE_FIELD_POINT_GRAVITY   1
+#define FORCE_FIELD_WIND            2
+#define FORCE_FIELD_LINEAR_DRAG     3
+#define FORCE_FIELD_QUADRATIC_DRAG  4
 
 #define testbodytype(L, arg, err) enums_test((L), DOMAIN_BODY_TYPE, (arg), (err))
 #define optbodytype(L, arg, defval) enums_opt((L), DOMAIN_BODY_TYPE, (arg), (defval))
@@ -55,6 +89,42 @@ void enums_freelist(lua_State *L, int *list);
 #define pushbodytype(L, val) enums_push((L), DOMAIN_BODY_TYPE, (int)(val))
 #define valuesbodytype(L) enums_values((L), DOMAIN_BODY_TYPE)
 
+#define testvecmode(L, arg, err) enums_test((L), DOMAIN_VEC_MODE, (arg), (err))
+#define optvecmode(L, arg, defval) enums_opt((L), DOMAIN_VEC_MODE, (arg), (defval))
+#define checkvecmode(L, arg) enums_check((L), DOMAIN_VEC_MODE, (arg))
+#define pushvecmode(L, val) enums_push((L), DOMAIN_VEC_MODE, (int)(val))
+#define valuesvecmode(L) enums_values((L), DOMAIN_VEC_MODE)
+
+#define testformat(L, arg, err) enums_test((L), DOMAIN_FORMAT, (arg), (err))
+#define optformat(L, arg, defval) enums_opt((L), DOMAIN_FORMAT, (arg), (defval))
+#define checkformat(L, arg) enums_check((L), DOMAIN_FORMAT, (arg))
+#define pushformat(L, val) enums_push((L), DOMAIN_FORMAT, (int)(val))
+#define valuesformat(L) enums_values((L), DOMAIN_FORMAT)
+
+#define testlayout(L, arg, err) enums_test((L), DOMAIN_LAYOUT, (arg), (err))
+#define optlayout(L, arg, defval) enums_opt((L), DOMAIN_LAYOUT, (arg), (defval))
+#define checklayout(L, arg) enums_check((L), DOMAIN_LAYOUT, (arg))
+#define pushlayout(L, val) enums_push((L), DOMAIN_LAYOUT, (int)(val))
+#define valueslayout(L) enums_values((L), DOMAIN_LAYOUT)
+
+#define testpresolverule(L, arg, err) enums_test((L), DOMAIN_PRE_SOLVE_RULE, (arg), (err))
+#define optpresolverule(L, arg, defval) enums_opt((L), DOMAIN_PRE_SOLVE_RULE, (arg), (defval))
+#define checkpresolverule(L, arg) enums_check((L), DOMAIN_PRE_SOLVE_RULE, (arg))
+#define pushpresolverule(L, val) enums_push((L), DOMAIN_PRE_SOLVE_RULE, (int)(val))
+#define valuespresolverule(L) enums_values((L), DOMAIN_PRE_SOLVE_RULE)
+
+#define testcollisionaction(L, arg, err) enums_test((L), DOMAIN_COLLISION_ACTION, (arg), (err))
+#define optcollisionaction(L, arg, defval) enums_opt((L), DOMAIN_COLLISION_ACTION, (arg), (defval))
+#define checkcollisionaction(L, arg) enums_check((L), DOMAIN_COLLISION_ACTION, (arg))
+#define pushcollisionaction(L, val) enums_push((L), DOMAIN_COLLISION_ACTION, (int)(val))
+#define valuescollisionaction(L) enums_values((L), DOMAIN_COLLISION_ACTION)
+
+#define testforcefield(L, arg, err) enums_test((L), DOMAIN_FORCE_FIELD, (arg), (err))
+#define optforcefield(L, arg, defval) enums_opt((L), DOMAIN_FORCE_FIELD, (arg), (defval))
+#define checkforcefield(L, arg) enums_check((L), DOMAIN_FORCE_FIELD, (arg))
+#define pushforcefield(L, val) enums_push((L), DOMAIN_FORCE_FIELD, (int)(val))
+#define valuesforcefield(L) enums_values((L), DOMAIN_FORCE_FIELD)
+
 #if 0 /* scaffolding 7yy */
 #define testxxx(L, arg, err) enums_test((L), DOMAIN_XXX, (arg), (err))
 #define optxxx(L, arg, defval) enums_opt((L), DOMAIN_XXX, (arg), (defval))
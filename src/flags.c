@@ -81,17 +81,128 @@ static int DebugDrawFlags(lua_State *L)
     ADD(SPACE_DEBUG_DRAW_CONSTRAINTS);\
     ADD(SPACE_DEBUG_DRAW_COLLISION_POINTS);\
 
+/*----------------------------------------------------------------------*
+ | Body fields (see packed.c)
+ *----------------------------------------------------------------------*/
+
+static int checkbodyfieldflags(lua_State *L, int arg) 
+    {
+    const char *s;
+    int flags = 0;
+    
+    while(lua_isstring(L, arg))
+        {
+        s = lua_tostring(L, arg++);
+#define CASE(CODE,str) if((strcmp(s, str)==0)) do { flags |= CODE; goto done; } while(0)
+    CASE(BODY_FIELD_POSITION, "position");
+    CASE(BODY_FIELD_ANGLE, "angle");
+    CASE(BODY_FIELD_VELOCITY, "velocity");
+    CASE(BODY_FIELD_ANGULAR_VELOCITY, "angular velocity");
+    CASE(BODY_FIELD_ID, "id");
+#undef CASE
+        return luaL_argerror(L, --arg, badvalue(L,s));
+        done: ;
+        }
+
+    return flags;
+    }
+
+static int pushbodyfieldflags(lua_State *L, int flags)
+    {
+    int n = 0;
+
+#define CASE(CODE,str) do { if( flags & CODE) { lua_pushstring(L, str); n++; } } while(0)
+    CASE(BODY_FIELD_POSITION, "position");
+    CASE(BODY_FIELD_ANGLE, "angle");
+    CASE(BODY_FIELD_VELOCITY, "velocity");
+    CASE(BODY_FIELD_ANGULAR_VELOCITY, "angular velocity");
+    CASE(BODY_FIELD_ID, "id");
+#undef CASE
+
+    return n;
+    }
+
+static int BodyFieldFlags(lua_State *L)
+    {
+    if(lua_type(L, 1) == LUA_TNUMBER)
+        return pushbodyfieldflags(L, luaL_checkinteger(L, 1));
+    lua_pushinteger(L, checkbodyfieldflags(L, 1));
+    return 1;
+    }
+
+#define ADD_(c) do { lua_pushinteger(L, c); lua_setfield(L, -2, #c); } while(0)
+#define Add_BodyFieldFlags(L) \
+    ADD_(BODY_FIELD_POSITION);\
+    ADD_(BODY_FIELD_ANGLE);\
+    ADD_(BODY_FIELD_VELOCITY);\
+    ADD_(BODY_FIELD_ANGULAR_VELOCITY);\
+    ADD_(BODY_FIELD_ID);\
+
+/*----------------------------------------------------------------------*
+ | Collision events (see collision_handler.c)
+ *----------------------------------------------------------------------*/
+
+static int checkcollisioneventflags(lua_State *L, int arg) 
+    {
+    const char *s;
+    int flags = 0;
+    
+    while(lua_isstring(L, arg))
+        {
+        s = lua_tostring(L, arg++);
+#define CASE(CODE,str) if((strcmp(s, str)==0)) do { flags |= CODE; goto done; } while(0)
+    CASE(COLLISION_EVENT_BEGIN, "begin");
+    CASE(COLLISION_EVENT_POST_SOLVE, "post solve");
+    CASE(COLLISION_EVENT_SEPARATE, "separate");
+#undef CASE
+        return luaL_argerror(L, --arg, badvalue(L,s));
+        done: ;
+        }
+
+    return flags;
+    }
+
+static int pushcollisioneventflags(lua_State *L, int flags)
+    {
+    int n = 0;
+
+#define CASE(CODE,str) do { if( flags & CODE) { lua_pushstring(L, str); n++; } } while(0)
+    CASE(COLLISION_EVENT_BEGIN, "begin");
+    CASE(COLLISION_EVENT_POST_SOLVE, "post solve");
+    CASE(COLLISION_EVENT_SEPARATE, "separate");
+#undef CASE
+
+    return n;
+    }
+
+static int CollisionEventFlags(lua_State *L)
+    {
+    if(lua_type(L, 1) == LUA_TNUMBER)
+        return pushcollisioneventflags(L, luaL_checkinteger(L, 1));
+    lua_pushinteger(L, checkcollisioneventflags(L, 1));
+    return 1;
+    }
+
+#define Add_CollisionEventFlags(L) \
+    ADD_(COLLISION_EVENT_BEGIN);\
+    ADD_(COLLISION_EVENT_POST_SOLVE);\
+    ADD_(COLLISION_EVENT_SEPARATE);\
+
 /*----------------------------------------------------------------------*/
 
 static int AddConstants(lua_State *L) /* cp.XXX constants for CP_XXX values */
     {
     Add_DebugDrawFlags(L);
+    Add_BodyFieldFlags(L);
+    Add_CollisionEventFlags(L);
     return 0;
     }
 
 static const struct luaL_Reg Functions[] = 
     {
         { "debugdrawflags", DebugDrawFlags },
+        { "bodyfieldflags", BodyFieldFlags },
+        { "collisioneventflags", CollisionEventFlags },
         { NULL, NULL } /* sentinel */
     };
 
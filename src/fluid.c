@@ -0,0 +1,138 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Stefano Trettel
+ *
+ * Software repository: MoonChipmunk, https://github.com/stetre/moonchipmunk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/*------------------------------------------------------------------------------*
+ | Native fluids                                                                |
+ *------------------------------------------------------------------------------*/
+
+/* This is a C port of the waterPreSolve() callback from the buoyancy demo (17-buoyancy.lua).
+ * The fluid is the first shape of the arbiter (a sensor), and its level is the top of its
+ * bounding box. The second shape is clipped against the level, and the buoyancy and drag
+ * impulses are applied to its body at the centroid of the submerged part.
+ * Circles are approximated with CIRCLE_VERTS-sided polygons, and other shapes are ignored.
+ */
+
+#define CIRCLE_VERTS 24
+#define MAX_VERTS 64 /* verts that fit in the stack buffers (more are Malloc'd) */
+
+static int worldverts(lua_State *L, shape_t *shape, body_t *body, vec_t *verts, int maxverts, vec_t **vertsp)
+/* Puts the world coordinates of the shape's vertices in verts (or in a Malloc'd array, if
+ * they do not fit in it), and returns their number (0 if the shape has no area). */
+    {
+    int i, n;
+    *vertsp = verts;
+    if(shape->klass->type == CP_POLY_SHAPE) /* need chipmunk_private.h for this */
+        {
+        n = cpPolyShapeGetCount(shape);
+        if(n > maxverts) *vertsp = verts = (vec_t*)Malloc(L, n*sizeof(vec_t));
+        for(i = 0; i < n; i++)
+            verts[i] = cpBodyLocalToWorld(body, cpPolyShapeGetVert(shape, i));
+        return n;
+        }
+    if(shape->klass->type == CP_CIRCLE_SHAPE)
+        {
+        vec_t c = cpBodyLocalToWorld(body, cpCircleShapeGetOffset(shape));
+        double r = cpCircleShapeGetRadius(shape);
+        for(i = 0; i < CIRCLE_VERTS; i++)
+            {
+            double a = 2*CP_PI*i/CIRCLE_VERTS;
+            verts[i] = cpv(c.x + r*cos(a), c.y + r*sin(a));
+            }
+        return CIRCLE_VERTS;
+        }
+    return 0;
+    }
+
+static int clip(const vec_t *verts, int n, double level, vec_t *clipped)
+/* Clips the polygon against the fluid level, and returns the no. of vertices
+ * of the submerged part (clipped must have room for 2*n vertices) */
+    {
+    int i, j, count = 0;
+    double alevel, blevel;
+    for(i = 0, j = n-1; i < n; j = i++)
+        {
+        vec_t a = verts[j], b = verts[i];
+        if(a.y < level) clipped[count++] = a;
+        alevel = a.y - level;
+        blevel = b.y - level;
+        if(alevel*blevel < 0.0)
+            {
+            double t = fabs(alevel)/(fabs(alevel) + fabs(blevel));
+            clipped[count++] = cpvlerp(a, b, t);
+            }
+        }
+    return count;
+    }
+
+static double k_scalar_body(body_t *body, vec_t point, vec_t n)
+    {
+    double rcn = cpvcross(cpvsub(point, cpBodyGetPosition(body)), n);
+    return 1.0/cpBodyGetMass(body) + rcn*rcn/cpBodyGetMoment(body);
+    }
+
+void applyfluid(lua_State *L, const fluid_t *fluid, cpArbiter *arbiter, space_t *space)
+    {
+    shape_t *water, *shape;
+    body_t *body;
+    vec_t verts[MAX_VERTS], clippedbuf[2*MAX_VERTS];
+    vec_t *v, *clipped = clippedbuf;
+    vec_t g, centroid, v_centroid, cog;
+    double level, area, dt, k, damping, v_coef, w_damping, w;
+    int n, count;
+
+    cpArbiterGetShapes(arbiter, &water, &shape);
+    body = cpShapeGetBody(shape);
+    if(cpBodyGetType(body) != CP_BODY_TYPE_DYNAMIC) return;
+    n = worldverts(L, shape, body, verts, MAX_VERTS, &v);
+    if(n < 3) goto done;
+    if(n > MAX_VERTS) clipped = (vec_t*)Malloc(L, 2*n*sizeof(vec_t));
+    level = cpShapeGetBB(water).t;
+    count = clip(v, n, level, clipped);
+    if(count < 3) goto done;
+    area = cpAreaForPoly(count, clipped, 0.0);
+    if(area <= 0.0) goto done;
+    centroid = cpCentroidForPoly(count, clipped);
+    dt = cpSpaceGetCurrentTimeStep(space);
+    g = cpSpaceGetGravity(space);
+    /* buoyancy */
+    cpBodyApplyImpulseAtWorldPoint(body, cpvmult(g, -area*fluid->density*dt), centroid);
+    /* linear drag */
+    v_centroid = cpBodyGetVelocityAtWorldPoint(body, centroid);
+    k = k_scalar_body(body, centroid, cpvnormalize(v_centroid));
+    damping = area*fluid->drag*fluid->density;
+    v_coef = exp(-damping*dt*k);
+    cpBodyApplyImpulseAtWorldPoint(body, cpvmult(v_centroid, (v_coef-1.0)/k), centroid);
+    /* angular drag */
+    cog = cpBodyLocalToWorld(body, cpBodyGetCenterOfGravity(body));
+    w_damping = cpMomentForPoly(fluid->angular_drag*fluid->density*area, count, clipped, cpvneg(cog), 0.0);
+    w = cpBodyGetAngularVelocity(body);
+    cpBodySetAngularVelocity(body, w*exp(-w_damping*dt/cpBodyGetMoment(body)));
+done:
+    if(v != verts) Free(L, v);
+    if(clipped != clippedbuf) Free(L, clipped);
+    }
+
@@ -29,7 +29,7 @@
 static int freegear_joint(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "gear_joint")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -60,6 +60,7 @@ GETDOUBLE(GetPhase, cpGearJointGetPhase, gear_joint)
 GETDOUBLE(GetRatio, cpGearJointGetRatio, gear_joint)
 
 DESTROY_FUNC(gear_joint)
+GC_FUNC(gear_joint, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -73,7 +74,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -29,7 +29,7 @@
 static int freegroove_joint(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "groove_joint")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -65,6 +65,7 @@ GETVEC(GetGrooveB, cpGrooveJointGetGrooveB, groove_joint)
 GETVEC(GetAnchorB, cpGrooveJointGetAnchorB, groove_joint)
 
 DESTROY_FUNC(groove_joint)
+GC_FUNC(groove_joint, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -80,7 +81,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
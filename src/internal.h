@@ -59,6 +59,18 @@
 #define checkflags(L, arg) luaL_checkinteger((L), (arg))
 #define optflags(L, arg, defval) luaL_optinteger((L), (arg), (defval))
 #define pushflags(L, val) lua_pushinteger((L), (val))
+/* Body fields for packed export/import (see packed.c) */
+#define BODY_FIELD_POSITION             0x01 /* x, y */
+#define BODY_FIELD_ANGLE                0x02 /* angle */
+#define BODY_FIELD_VELOCITY             0x04 /* vx, vy */
+#define BODY_FIELD_ANGULAR_VELOCITY     0x08 /* w */
+#define BODY_FIELD_ID                   0x10 /* id */
+/* Collision events recorded in the space's event ring (see collision_handler.c) */
+#define COLLISION_EVENT_BEGIN           0x01
+#define COLLISION_EVENT_POST_SOLVE      0x02
+#define COLLISION_EVENT_SEPARATE        0x04
+#define COLLISION_EVENT_RECSIZE         10 /* event, a, b, nx, ny, px, py, jx, jy, ke */
+#define IMPACT_RECSIZE                  6  /* a, b, first, jx, jy, ke */
 
 /* cpCollisionType */
 #define checkcollisiontype(L, arg) (cpCollisionType)luaL_checkinteger((L), (arg))
@@ -108,8 +120,9 @@ int optindex(lua_State *L, int arg, int optval);
 void pushindex(lua_State *L, int val);
 
 /* datastructs.c */
+#define VEC_MT "moonchipmunk_vec" /* compact vec (not an object, just a userdata containing a vec_t) */
 #define isglmathcompat moonchipmunk_isglmathcompat
-int isglmathcompat(void);
+int isglmathcompat(lua_State *L);
 #define glmathcompat moonchipmunk_glmathcompat
 int glmathcompat(lua_State *L, int on);
 
@@ -121,6 +134,10 @@ int optvec(lua_State *L, int arg, vec_t *dst);
 int checkvec(lua_State *L, int arg, vec_t *dst);
 #define pushvec moonchipmunk_pushvec
 void pushvec(lua_State *L, const vec_t *val);
+#define pushvecout moonchipmunk_pushvecout
+void pushvecout(lua_State *L, int arg, const vec_t *val);
+#define newvec moonchipmunk_newvec
+void newvec(lua_State *L, const vec_t *val);
 #define checkveclist moonchipmunk_checkveclist
 vec_t *checkveclist(lua_State *L, int arg, int *countp, int *err);
 #define pushveclist moonchipmunk_pushveclist
@@ -193,40 +210,200 @@ void pushshapefilter(lua_State *L, cpShapeFilter *val);
 #define errstring moonchipmunk_errstring
 const char* errstring(int err);
 
-/* tracing.c */
-#define trace_objects moonchipmunk_trace_objects
-extern int trace_objects;
-
 /* shape.c */
 #define shapedestroy moonchipmunk_shapedestroy
 int shapedestroy(lua_State *L, shape_t *shape);
 #define candestroyshape moonchipmunk_candestroyshape
-int candestroyshape(shape_t *shape, ud_t *ud);
+int candestroyshape(lua_State *L, shape_t *shape, ud_t *ud);
 
 /* collision_handler.c */
 #define newcollision_handler moonchipmunk_newcollision_handler
 int newcollision_handler(lua_State *L, collision_handler_t *handler, space_t *space);
+#define handlercallslua moonchipmunk_handlercallslua
+int handlercallslua(collision_handler_t *handler);
+#define releasestickyjoints moonchipmunk_releasestickyjoints
+void releasestickyjoints(lua_State *L, ud_t *space_ud);
 
 /* constraint.c */
 #define constraintdestroy moonchipmunk_constraintdestroy
 int constraintdestroy(lua_State *L, constraint_t *constraint);
 #define candestroyconstraint moonchipmunk_candestroyconstraint
-int candestroyconstraint(constraint_t *constraint, ud_t *ud);
+int candestroyconstraint(lua_State *L, constraint_t *constraint, ud_t *ud);
+#define constraintcallslua moonchipmunk_constraintcallslua
+int constraintcallslua(constraint_t *constraint);
 
 /* body.c */
 #define freebody moonchipmunk_freebody
 int freebody(lua_State *L, ud_t *ud);
 #define newbody moonchipmunk_newbody
 int newbody(lua_State *L, body_t *body, int borrowed);
+#define bodycallslua moonchipmunk_bodycallslua
+int bodycallslua(body_t *body);
+
+/* pivot_joint.c */
+#define newpivot_joint moonchipmunk_newpivot_joint
+int newpivot_joint(lua_State *L, constraint_t *constraint);
+
+/* packed.c */
+#define BUFFER_MT "moonchipmunk_buffer" /* byte buffer (not an object, just a userdata) */
+#define testbuffer moonchipmunk_testbuffer
+void *testbuffer(lua_State *L, int arg, size_t *size);
+#define checkbuffer moonchipmunk_checkbuffer
+void *checkbuffer(lua_State *L, int arg, size_t *size);
+#define checkdata moonchipmunk_checkdata
+const void *checkdata(lua_State *L, int arg, size_t *size);
+#define stepper_t moonchipmunk_stepper_t
+typedef struct moonchipmunk_stepper_s stepper_t;
+#define freestepper moonchipmunk_freestepper
+void freestepper(lua_State *L, stepper_t *stepper);
+#define async_t moonchipmunk_async_t
+typedef struct moonchipmunk_async_s async_t;
+#define freeasync moonchipmunk_freeasync
+void freeasync(lua_State *L, async_t *async);
+#define asyncbusy moonchipmunk_asyncbusy
+int asyncbusy(ud_t *ud);
+#define spacebusy moonchipmunk_spacebusy
+int spacebusy(lua_State *L, space_t *space);
+#define waitspace moonchipmunk_waitspace
+void waitspace(lua_State *L, space_t *space);
+
+/* batch.c */
+#define pool_t moonchipmunk_pool_t
+typedef struct pool_s pool_t;
+#define freebatchpool moonchipmunk_freebatchpool
+void freebatchpool(lua_State *L, pool_t *pool);
+
+/* records.c */
+#define records_t moonchipmunk_records_t
+typedef struct {
+    double *data;       /* records (allocated at the first newrecord()) */
+    size_t recsize;     /* no. of doubles per record */
+    size_t capacity;    /* max no. of records (before growing, if not a ring) */
+    size_t first;       /* index of the oldest record */
+    size_t count;       /* no. of records */
+    size_t lost;        /* no. of records overwritten since the last drain (ring only) */
+    int ring;           /* 1 = ring, 0 = growable array */
+} records_t;
+#define initrecords moonchipmunk_initrecords
+void initrecords(records_t *r, size_t recsize, size_t capacity, int ring);
+#define freerecords moonchipmunk_freerecords
+void freerecords(lua_State *L, records_t *r);
+#define resizerecords moonchipmunk_resizerecords
+void resizerecords(lua_State *L, records_t *r, size_t capacity);
+#define newrecord moonchipmunk_newrecord
+double *newrecord(lua_State *L, records_t *r);
+#define drainrecords moonchipmunk_drainrecords
+int drainrecords(lua_State *L, int arg, records_t *r, const char *fields[], int nint);
+
+/* collision_handler.c */
+#define rule_t moonchipmunk_rule_t
+typedef struct { /* native pre-solve rule */
+    int kind; /* RULE_XXX */
+    vec_t v;
+    double k;
+} rule_t;
+#define checkrule moonchipmunk_checkrule
+int checkrule(lua_State *L, int arg, rule_t *rule);
+#define applyrules moonchipmunk_applyrules
+cpBool applyrules(const rule_t *rules, int nrules, cpArbiter *arbiter);
+
+/* fluid.c */
+#define fluid_t moonchipmunk_fluid_t
+typedef struct { /* native fluid (see collision_handler:set_fluid()) */
+    double density;
+    double drag; /* linear drag coefficient */
+    double angular_drag; /* angular drag coefficient */
+} fluid_t;
+#define applyfluid moonchipmunk_applyfluid
+void applyfluid(lua_State *L, const fluid_t *fluid, cpArbiter *arbiter, space_t *space);
+
+/* tracing.c */
+#define CALLBACK_HANDLER        0   /* collision handler callbacks */
+#define CALLBACK_BODY           1   /* body velocity and position update functions */
+#define CALLBACK_CONSTRAINT     2   /* constraint pre-solve and post-solve functions */
+#define CALLBACK_POST_STEP      3   /* post-step callbacks (and break funcs) */
+#define NCALLBACKKINDS          4
+#define stepstats_t moonchipmunk_stepstats_t
+typedef struct moonchipmunk_stepstats_s stepstats_t;
+#define tracer_t moonchipmunk_tracer_t
+typedef struct moonchipmunk_tracer_s tracer_t;
+#define TRACE_NOARG LLONG_MIN
+#define tracecomplete moonchipmunk_tracecomplete
+void tracecomplete(tracer_t *tracer, const char *cat, const char *name, double t0, long long a, long long b);
+#define traceinstant moonchipmunk_traceinstant
+void traceinstant(tracer_t *tracer, const char *cat, const char *name, const void *handle);
+#define freetracer moonchipmunk_freetracer
+void freetracer(lua_State *L, tracer_t *tracer);
+/* Span tracing: t0 = tracebegin(ctx); ...; traceend(ctx, cat, name, t0);
+ * t0 = 0 means that no tracer was active at the begin, and the span is dropped
+ * (e.g. if a callback in between installed one). */
+#define tracebegin(ctx) ((ctx)->tracer ? now() : 0)
+#define traceend(ctx, cat, name, t0) do {                                   \
+    if((ctx)->tracer && (t0) != 0)                                          \
+        tracecomplete((ctx)->tracer, (cat), (name), (t0), TRACE_NOARG, TRACE_NOARG); \
+} while(0)
+#define tracedpcall moonchipmunk_tracedpcall
+int tracedpcall(lua_State *L, space_t *space, int kind, const char *name, long long a, long long b, int nargs, int nresults);
+#define timedpcall moonchipmunk_timedpcall
+int timedpcall(lua_State *L, space_t *space, int kind, int nargs, int nresults);
+#define timedstep moonchipmunk_timedstep
+void timedstep(stepstats_t *stats, space_t *space, int hasty, double dt);
+#define freestepstats moonchipmunk_freestepstats
+void freestepstats(lua_State *L, space_t *space, stepstats_t *stats);
+
+/* space.c */
+#define usesspatialhash moonchipmunk_usesspatialhash
+int usesspatialhash(ud_t *ud);
+#define spaceevents moonchipmunk_spaceevents
+records_t *spaceevents(ud_t *ud);
+#define spaceimpacts moonchipmunk_spaceimpacts
+records_t *spaceimpacts(ud_t *ud);
+#define spacestepper moonchipmunk_spacestepper
+stepper_t **spacestepper(ud_t *ud);
+#define spacestepstats moonchipmunk_spacestepstats
+stepstats_t **spacestepstats(ud_t *ud);
+#define spaceasync moonchipmunk_spaceasync
+async_t **spaceasync(ud_t *ud);
+#define stepspace moonchipmunk_stepspace
+void stepspace(ud_t *ud, double dt);
+#define breakconstraint moonchipmunk_breakconstraint
+void breakconstraint(lua_State *L, space_t *space, constraint_t *constraint);
+
+/* arbiter.c */
+#define snapdata_t moonchipmunk_snapdata_t
+typedef struct moonchipmunk_snapdata_s snapdata_t;
+#define freesnapdata moonchipmunk_freesnapdata
+void freesnapdata(lua_State *L, snapdata_t *pool);
 
 /* main.c */
-extern lua_State *moonchipmunk_L;
+#define ctx_t moonchipmunk_ctx_t
+typedef struct moonchipmunk_ctx_s ctx_t;
+struct moonchipmunk_ctx_s { /* per-state context */
+    lua_State *L; /* the main thread of the state (used in callbacks) */
+    arbiter_t *arbiter; /* the arbiter currently bound to the singleton (see arbiter.c) */
+    int tovec2, tovec4, tomat2x3, tobox2; /* glmath compatibility (see datastructs.c) */
+    int vec_mode; /* VEC_MODE_XXX, representation of pushed vecs (see datastructs.c) */
+    int trace_objects; /* see tracing.c */
+    pool_t *pool; /* worker threads for batched queries (see batch.c) */
+    stepstats_t *stepstats; /* stats of the space being stepped, if enabled (see tracing.c) */
+    tracer_t *tracer; /* trace recorder, or NULL if not tracing (see tracing.c) */
+    uint64_t serial; /* last serial number assigned to an object (see newuserdata()) */
+    int asyncsteps; /* no. of async steps in progress (see packed.c) */
+    snapdata_t *snapdata; /* pool of released snapshot data (see arbiter.c) */
+};
+#define getctx moonchipmunk_getctx
+ctx_t *getctx(lua_State *L);
+/* Every space has the context of the state that created it as user data: */
+#define spacectx(space) ((ctx_t*)cpSpaceGetUserData((space)))
 MOONCHIPMUNK_EXPORT int luaopen_moonchipmunk(lua_State *L);
 void moonchipmunk_open_enums(lua_State *L);
+void moonchipmunk_open_datastructs(lua_State *L);
 void moonchipmunk_open_flags(lua_State *L);
 void moonchipmunk_open_tracing(lua_State *L);
 void moonchipmunk_open_misc(lua_State *L);
 void moonchipmunk_open_space(lua_State *L);
+void moonchipmunk_open_packed(lua_State *L);
+void moonchipmunk_open_batch(lua_State *L);
 void moonchipmunk_open_body(lua_State *L);
 void moonchipmunk_open_shape(lua_State *L);
 void moonchipmunk_open_circle(lua_State *L);
@@ -25,15 +25,56 @@
 
 #include "internal.h"
 
-lua_State *moonchipmunk_L;
+static const char CtxKey = 0; /* its address is the key for the context in the Lua registry */
 
-static void AtExit(void)
+ctx_t *getctx(lua_State *L)
     {
-    if(moonchipmunk_L)
-        {
-        enums_free_all(moonchipmunk_L);
-        moonchipmunk_L = NULL;
-        }
+    ctx_t *ctx;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &CtxKey);
+    ctx = (ctx_t*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if(!ctx) { unexpected(L); return NULL; }
+    return ctx;
+    }
+
+static int CtxGC(lua_State *L)
+    {
+    ctx_t *ctx = (ctx_t*)lua_touserdata(L, 1);
+    freebatchpool(L, ctx->pool);
+    ctx->pool = NULL;
+    freetracer(L, ctx->tracer);
+    ctx->tracer = NULL;
+    freesnapdata(L, ctx->snapdata);
+    ctx->snapdata = NULL;
+    return 0;
+    }
+
+static void newctx(lua_State *L)
+/* Creates the per-state context, anchored in the Lua registry so that it lives
+ * as long as the state does. */
+    {
+    ctx_t *ctx;
+    if(lua_rawgetp(L, LUA_REGISTRYINDEX, &CtxKey) != LUA_TNIL)
+        { luaL_error(L, "moonchipmunk already loaded in this state"); return; }
+    lua_pop(L, 1);
+    ctx = (ctx_t*)lua_newuserdata(L, sizeof(ctx_t));
+    memset(ctx, 0, sizeof(ctx_t));
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    ctx->L = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    ctx->arbiter = NULL;
+    ctx->tovec2 = ctx->tovec4 = ctx->tomat2x3 = ctx->tobox2 = LUA_NOREF;
+    ctx->vec_mode = VEC_MODE_TABLE;
+    ctx->trace_objects = 0;
+    ctx->pool = NULL;
+    ctx->stepstats = NULL;
+    ctx->tracer = NULL;
+    ctx->serial = 0;
+    lua_newtable(L); /* its metatable */
+    lua_pushcfunction(L, CtxGC);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &CtxKey);
     }
  
 static int AddVersions(lua_State *L)
@@ -69,7 +110,7 @@ static int AddConstants(lua_State *L)
 
 static int IsGlmathCompat(lua_State *L)
     {
-    lua_pushboolean(L, isglmathcompat());
+    lua_pushboolean(L, isglmathcompat(L));
     return 1;
     }
 
@@ -90,20 +131,21 @@ static const struct luaL_Reg Functions[] =
 int luaopen_moonchipmunk(lua_State *L)
 /* Lua calls this function to load the module */
     {
-    moonchipmunk_L = L;
-
+    newctx(L);
     moonchipmunk_utils_init(L);
-    atexit(AtExit);
 
     lua_newtable(L); /* the module table */
     moonchipmunk_open_enums(L);
     moonchipmunk_open_flags(L);
+    moonchipmunk_open_datastructs(L);
     AddVersions(L);
     AddConstants(L);
     luaL_setfuncs(L, Functions, 0);
     moonchipmunk_open_tracing(L);
     moonchipmunk_open_misc(L);
     moonchipmunk_open_space(L);
+    moonchipmunk_open_packed(L);
+    moonchipmunk_open_batch(L);
     moonchipmunk_open_body(L);
     moonchipmunk_open_shape(L);
     moonchipmunk_open_circle(L);
@@ -813,16 +813,15 @@ static int BBOffset(lua_State *L)
  | cpMarchXxx()                                                                 |
  *------------------------------------------------------------------------------*/
 
-static int ref_sample = LUA_NOREF;
-static int ref_segment = LUA_NOREF;
+/* The callbacks are called with the stack of the cpMarchXxx() caller,
+ * having the sample function at index 5 and the segment function at index 6. */
 
 static double MarchSampleFunc(vec_t point, void *data)
     {
     double density;
-    lua_State *L = moonchipmunk_L;
+    lua_State *L = (lua_State*)data;
     int top = lua_gettop(L);
-    (void)data;
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ref_sample);
+    lua_pushvalue(L, 5);
     pushvec(L, &point);
     if(lua_pcall(L, 1, 1, 0)!=LUA_OK)
         { lua_error(L); return 0.0f; }
@@ -833,10 +832,9 @@ static double MarchSampleFunc(vec_t point, void *data)
 
 static void MarchSegmentFunc(vec_t v0, vec_t v1, void *data)
     {
-    lua_State *L = moonchipmunk_L;
+    lua_State *L = (lua_State*)data;
     int top = lua_gettop(L);
-    (void)data;
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ref_segment);
+    lua_pushvalue(L, 6);
     pushvec(L, &v0);
     pushvec(L, &v1);
     if(lua_pcall(L, 2, 0, 0)!=LUA_OK)
@@ -857,11 +855,8 @@ static int Func(lua_State *L)                                       \
     threshold = luaL_checknumber(L, 4);                             \
     if(!lua_isfunction(L, 5)) return argerror(L, 5, ERR_FUNCTION);  \
     if(!lua_isfunction(L, 6)) return argerror(L, 6, ERR_FUNCTION);  \
-    Reference(L, 5, ref_sample);                                    \
-    Reference(L, 6, ref_segment);                                   \
-    func(bb, x_samples, y_samples, threshold, MarchSegmentFunc, NULL, MarchSampleFunc, NULL);   \
-    Unreference(L, ref_sample);                                     \
-    Unreference(L, ref_segment);                                    \
+    lua_settop(L, 6);                                               \
+    func(bb, x_samples, y_samples, threshold, MarchSegmentFunc, L, MarchSampleFunc, L);   \
     return 0;                                                       \
     }
 F(MarchSoft, cpMarchSoft)
@@ -28,49 +28,82 @@
 ud_t *newuserdata(lua_State *L, void *handle, const char *mt, const char *tracename)
     {
     ud_t *ud;
+    ctx_t *ctx;
     /* we use handle as search key */
     ud = (ud_t*)udata_new(L, sizeof(ud_t), (uint64_t)(uintptr_t)handle, mt);
     memset(ud, 0, sizeof(ud_t));
     ud->handle = handle;
+    ud->mt = mt;
     MarkValid(ud);
-    if(trace_objects)
-        printf("create %s %p (%p)\n", tracename, (void*)ud, handle);
+    ctx = getctx(L);
+    ud->serial = ++ctx->serial;
+    if(ctx->trace_objects && ctx->tracer)
+        traceinstant(ctx->tracer, "create", tracename, handle);
     return ud;
     }
 
 int freeuserdata(lua_State *L, ud_t *ud, const char *tracename)
     {
+    ctx_t *ctx;
     /* The 'Valid' mark prevents double calls when an object is explicitly destroyed, 
      * and subsequently deleted also by the GC (the ud sticks around until the GC
      * collects it, so we mark it as invalid when the object is explicitly destroyed
      * by the script, or implicitly destroyed because child of a destroyed object). */
     if(!IsValid(ud)) return 0;
     CancelValid(ud);
+    setparent(ud, NULL);
+    while(ud->first_child) /* orphan any children left */
+        setparent(ud->first_child, NULL);
     if(ud->info) 
         Free(L, ud->info);
     if(ud->ref1!=LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, ud->ref1);
     if(ud->ref2!=LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, ud->ref2);
     if(ud->ref3!=LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, ud->ref3);
-    if(trace_objects)
-        printf("delete %s %p (%p)\n", tracename, (void*)ud, ud->handle);
+    ctx = getctx(L);
+    if(ctx->trace_objects && ctx->tracer)
+        traceinstant(ctx->tracer, "delete", tracename, ud->handle);
     udata_free(L, (uint64_t)(uintptr_t)ud->handle);
     return 1;
     }
 
-static int freeifchild(lua_State *L, const void *mem, const char *mt, const void *parent_ud)
-/* callback for udata_scan */
+void setparent(ud_t *ud, ud_t *parent_ud)
+/* Sets parent_ud as the parent of ud (or none, if parent_ud=NULL), and moves
+ * ud in the list of children of its new parent. */
     {
-    ud_t *ud = (ud_t*)mem;
-    (void)mt;
-    if(IsValid(ud) && (ud->parent_ud == parent_ud))
-        ud->destructor(L, ud);
-    return 0;
+    if(ud->parent_ud)
+        {
+        if(ud->prev_sibling) 
+            ud->prev_sibling->next_sibling = ud->next_sibling;
+        else
+            ud->parent_ud->first_child = ud->next_sibling;
+        if(ud->next_sibling)
+            ud->next_sibling->prev_sibling = ud->prev_sibling;
+        }
+    ud->parent_ud = parent_ud;
+    ud->prev_sibling = NULL;
+    ud->next_sibling = NULL;
+    if(parent_ud)
+        {
+        ud->next_sibling = parent_ud->first_child;
+        if(parent_ud->first_child)
+            parent_ud->first_child->prev_sibling = ud;
+        parent_ud->first_child = ud;
+        }
     }
 
 int freechildren(lua_State *L,  const char *mt, ud_t *parent_ud)
-/* calls the self destructor for all 'mt' objects that are children of the given parent_ud */
+/* calls the self destructor for all 'mt' objects that are children of the given parent_ud
+ * (a destructor unlinks its own object from the list, and must not destroy its siblings)
+ */
     {
-    return udata_scan(L, mt, parent_ud, freeifchild);
+    ud_t *ud, *next;
+    for(ud = parent_ud->first_child; ud != NULL; ud = next)
+        {
+        next = ud->next_sibling;
+        if((ud->mt == mt) && IsValid(ud))
+            ud->destructor(L, ud);
+        }
+    return 0;
     }
 
 int pushuserdata(lua_State *L, ud_t *ud)
@@ -79,9 +112,9 @@ int pushuserdata(lua_State *L, ud_t *ud)
     return udata_push(L, (uint64_t)(uintptr_t)ud->handle);
     }
 
-ud_t *userdata(const void *handle)
+ud_t *userdata(lua_State *L, const void *handle)
     {
-    ud_t *ud = (ud_t*)udata_mem((uint64_t)(uintptr_t)handle);
+    ud_t *ud = (ud_t*)udata_mem(L, (uint64_t)(uintptr_t)handle);
     if(ud && IsValid(ud)) return ud;
     return NULL;
     }
@@ -70,9 +70,13 @@ struct moonchipmunk_ud_s {
     void *handle; /* the object handle bound to this userdata */
     int (*destructor)(lua_State *L, ud_t *ud);  /* self destructor */
     ud_t *parent_ud; /* the ud of the parent object */
+    ud_t *first_child; /* list of children (see setparent()) */
+    ud_t *prev_sibling, *next_sibling; /* links in the parent's list of children */
+    const char *mt; /* the object's metatable */
     uint32_t marks;
     int ref1, ref2, ref3, ref4; /* refs for callbacks, automatically unreferenced at destruction */
     body_t *static_body;
+    uint64_t serial; /* serial number, unique in the Lua state (never reused) */
     void *info; /* object specific info (ud_info_t, subject to Free() at destruction, if not NULL) */
 };
     
@@ -108,14 +112,16 @@ int freeuserdata(lua_State *L, ud_t *ud, const char *tracename);
 #define pushuserdata moonchipmunk_pushuserdata 
 int pushuserdata(lua_State *L, ud_t *ud);
 
+#define setparent moonchipmunk_setparent
+void setparent(ud_t *ud, ud_t *parent_ud);
 #define freechildren moonchipmunk_freechildren
 int freechildren(lua_State *L,  const char *mt, ud_t *parent_ud);
 
 #define userdata_unref(L, handle) udata_unref((L),(handle))
 
-#define UD(handle) userdata((handle)) /* dispatchable objects only */
+#define UD(L, handle) userdata((L), (handle)) /* dispatchable objects only */
 #define userdata moonchipmunk_userdata
-ud_t *userdata(const void *handle);
+ud_t *userdata(lua_State *L, const void *handle);
 #define testxxx moonchipmunk_testxxx
 void *testxxx(lua_State *L, int arg, ud_t **udp, const char *mt);
 #define checkxxx moonchipmunk_checkxxx
@@ -138,103 +144,114 @@ void** checkxxxlist(lua_State *L, int arg, int *count, int *err, const char *mt)
 #endif
 
 /* space.c */
-#define checkspace(L, arg, udp) (space_t*)checkxxx((L), (arg), (udp), SPACE_MT)
+#define checkidlespace moonchipmunk_checkidlespace
+space_t *checkidlespace(lua_State *L, int arg, ud_t **udp);
+#define checkspace(L, arg, udp) checkidlespace((L), (arg), (udp)) /* see packed.c */
+#define checkanyspace(L, arg, udp) (space_t*)checkxxx((L), (arg), (udp), SPACE_MT)
 #define testspace(L, arg, udp) (space_t*)testxxx((L), (arg), (udp), SPACE_MT)
 #define optspace(L, arg, udp) (space_t*)optxxx((L), (arg), (udp), SPACE_MT)
 #define pushspace(L, handle) pushxxx((L), (void*)(handle))
 
 /* body.c */
-#define checkbody(L, arg, udp) (body_t*)checkxxx((L), (arg), (udp), BODY_MT)
+#define checkidlebody moonchipmunk_checkidlebody
+body_t *checkidlebody(lua_State *L, int arg, ud_t **udp);
+#define checkbody(L, arg, udp) checkidlebody((L), (arg), (udp)) /* see packed.c */
+#define checkanybody(L, arg, udp) (body_t*)checkxxx((L), (arg), (udp), BODY_MT)
 #define testbody(L, arg, udp) (body_t*)testxxx((L), (arg), (udp), BODY_MT)
 #define optbody(L, arg, udp) (body_t*)optxxx((L), (arg), (udp), BODY_MT)
 #define pushbody(L, handle) pushxxx((L), (void*)(handle))
+#define checkbodylist(L, arg, count, err) (body_t**)checkxxxlist((L), (arg), (count), (err), BODY_MT)
 
 /* shape.c */
-#define checkshape(L, arg, udp) (shape_t*)checkxxx((L), (arg), (udp), SHAPE_MT)
+#define checkidleshape moonchipmunk_checkidleshape
+shape_t *checkidleshape(lua_State *L, int arg, ud_t **udp, const char *mt);
+#define checkshape(L, arg, udp) checkidleshape((L), (arg), (udp), SHAPE_MT)
 #define testshape(L, arg, udp) (shape_t*)testxxx((L), (arg), (udp), SHAPE_MT)
 #define optshape(L, arg, udp) (shape_t*)optxxx((L), (arg), (udp), SHAPE_MT)
 #define pushshape(L, handle) pushxxx((L), (void*)(handle))
 
 /* circle.c */
-#define checkcircle(L, arg, udp) (shape_t*)checkxxx((L), (arg), (udp), CIRCLE_MT)
+#define checkcircle(L, arg, udp) checkidleshape((L), (arg), (udp), CIRCLE_MT)
 #define testcircle(L, arg, udp) (shape_t*)testxxx((L), (arg), (udp), CIRCLE_MT)
 #define optcircle(L, arg, udp) (shape_t*)optxxx((L), (arg), (udp), CIRCLE_MT)
 #define pushcircle(L, handle) pushxxx((L), (void*)(handle))
 
 /* segment.c */
-#define checksegment(L, arg, udp) (shape_t*)checkxxx((L), (arg), (udp), SEGMENT_MT)
+#define checksegment(L, arg, udp) checkidleshape((L), (arg), (udp), SEGMENT_MT)
 #define testsegment(L, arg, udp) (shape_t*)testxxx((L), (arg), (udp), SEGMENT_MT)
 #define optsegment(L, arg, udp) (shape_t*)optxxx((L), (arg), (udp), SEGMENT_MT)
 #define pushsegment(L, handle) pushxxx((L), (void*)(handle))
 
 /* poly.c */
-#define checkpoly(L, arg, udp) (shape_t*)checkxxx((L), (arg), (udp), POLY_MT)
+#define checkpoly(L, arg, udp) checkidleshape((L), (arg), (udp), POLY_MT)
 #define testpoly(L, arg, udp) (shape_t*)testxxx((L), (arg), (udp), POLY_MT)
 #define optpoly(L, arg, udp) (shape_t*)optxxx((L), (arg), (udp), POLY_MT)
 #define pushpoly(L, handle) pushxxx((L), (void*)(handle))
 
 /* constraint.c */
-#define checkconstraint(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), CONSTRAINT_MT)
+#define checkidleconstraint moonchipmunk_checkidleconstraint
+constraint_t *checkidleconstraint(lua_State *L, int arg, ud_t **udp, const char *mt);
+#define checkconstraint(L, arg, udp) checkidleconstraint((L), (arg), (udp), CONSTRAINT_MT)
 #define testconstraint(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), CONSTRAINT_MT)
 #define optconstraint(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), CONSTRAINT_MT)
 #define pushconstraint(L, handle) pushxxx((L), (void*)(handle))
 
 /* pin_joint.c */
-#define checkpin_joint(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), PIN_JOINT_MT)
+#define checkpin_joint(L, arg, udp) checkidleconstraint((L), (arg), (udp), PIN_JOINT_MT)
 #define testpin_joint(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), PIN_JOINT_MT)
 #define optpin_joint(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), PIN_JOINT_MT)
 #define pushpin_joint(L, handle) pushxxx((L), (void*)(handle))
 
 /* slide_joint.c */
-#define checkslide_joint(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), SLIDE_JOINT_MT)
+#define checkslide_joint(L, arg, udp) checkidleconstraint((L), (arg), (udp), SLIDE_JOINT_MT)
 #define testslide_joint(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), SLIDE_JOINT_MT)
 #define optslide_joint(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), SLIDE_JOINT_MT)
 #define pushslide_joint(L, handle) pushxxx((L), (void*)(handle))
 
 /* pivot_joint.c */
-#define checkpivot_joint(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), PIVOT_JOINT_MT)
+#define checkpivot_joint(L, arg, udp) checkidleconstraint((L), (arg), (udp), PIVOT_JOINT_MT)
 #define testpivot_joint(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), PIVOT_JOINT_MT)
 #define optpivot_joint(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), PIVOT_JOINT_MT)
 #define pushpivot_joint(L, handle) pushxxx((L), (void*)(handle))
 
 /* groove_joint.c */
-#define checkgroove_joint(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), GROOVE_JOINT_MT)
+#define checkgroove_joint(L, arg, udp) checkidleconstraint((L), (arg), (udp), GROOVE_JOINT_MT)
 #define testgroove_joint(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), GROOVE_JOINT_MT)
 #define optgroove_joint(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), GROOVE_JOINT_MT)
 #define pushgroove_joint(L, handle) pushxxx((L), (void*)(handle))
 
 /* damped_spring.c */
-#define checkdamped_spring(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), DAMPED_SPRING_MT)
+#define checkdamped_spring(L, arg, udp) checkidleconstraint((L), (arg), (udp), DAMPED_SPRING_MT)
 #define testdamped_spring(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), DAMPED_SPRING_MT)
 #define optdamped_spring(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), DAMPED_SPRING_MT)
 #define pushdamped_spring(L, handle) pushxxx((L), (void*)(handle))
 
 /* damped_rotary_spring.c */
-#define checkdamped_rotary_spring(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), DAMPED_ROTARY_SPRING_MT)
+#define checkdamped_rotary_spring(L, arg, udp) checkidleconstraint((L), (arg), (udp), DAMPED_ROTARY_SPRING_MT)
 #define testdamped_rotary_spring(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), DAMPED_ROTARY_SPRING_MT)
 #define optdamped_rotary_spring(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), DAMPED_ROTARY_SPRING_MT)
 #define pushdamped_rotary_spring(L, handle) pushxxx((L), (void*)(handle))
 
 /* rotary_limit_joint.c */
-#define checkrotary_limit_joint(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), ROTARY_LIMIT_JOINT_MT)
+#define checkrotary_limit_joint(L, arg, udp) checkidleconstraint((L), (arg), (udp), ROTARY_LIMIT_JOINT_MT)
 #define testrotary_limit_joint(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), ROTARY_LIMIT_JOINT_MT)
 #define optrotary_limit_joint(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), ROTARY_LIMIT_JOINT_MT)
 #define pushrotary_limit_joint(L, handle) pushxxx((L), (void*)(handle))
 
 /* ratchet_joint.c */
-#define checkratchet_joint(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), RATCHET_JOINT_MT)
+#define checkratchet_joint(L, arg, udp) checkidleconstraint((L), (arg), (udp), RATCHET_JOINT_MT)
 #define testratchet_joint(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), RATCHET_JOINT_MT)
 #define optratchet_joint(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), RATCHET_JOINT_MT)
 #define pushratchet_joint(L, handle) pushxxx((L), (void*)(handle))
 
 /* gear_joint.c */
-#define checkgear_joint(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), GEAR_JOINT_MT)
+#define checkgear_joint(L, arg, udp) checkidleconstraint((L), (arg), (udp), GEAR_JOINT_MT)
 #define testgear_joint(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), GEAR_JOINT_MT)
 #define optgear_joint(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), GEAR_JOINT_MT)
 #define pushgear_joint(L, handle) pushxxx((L), (void*)(handle))
 
 /* simple_motor.c */
-#define checksimple_motor(L, arg, udp) (constraint_t*)checkxxx((L), (arg), (udp), SIMPLE_MOTOR_MT)
+#define checksimple_motor(L, arg, udp) checkidleconstraint((L), (arg), (udp), SIMPLE_MOTOR_MT)
 #define testsimple_motor(L, arg, udp) (constraint_t*)testxxx((L), (arg), (udp), SIMPLE_MOTOR_MT)
 #define optsimple_motor(L, arg, udp) (constraint_t*)optxxx((L), (arg), (udp), SIMPLE_MOTOR_MT)
 #define pushsimple_motor(L, handle) pushxxx((L), (void*)(handle))
@@ -247,7 +264,9 @@ void invalidatearbiter(lua_State *L, arbiter_t *arbiter);
 #define testarbiter(L, arg, udp) testxxx((L), (arg), (udp), ARBITER_MT)
 
 /* collision_handler.c */
-#define checkcollision_handler(L, arg, udp) (collision_handler_t*)checkxxx((L), (arg), (udp), COLLISION_HANDLER_MT)
+#define checkidlecollision_handler moonchipmunk_checkidlecollision_handler
+collision_handler_t *checkidlecollision_handler(lua_State *L, int arg, ud_t **udp);
+#define checkcollision_handler(L, arg, udp) checkidlecollision_handler((L), (arg), (udp))
 #define testcollision_handler(L, arg, udp) (collision_handler_t*)testxxx((L), (arg), (udp), COLLISION_HANDLER_MT)
 #define optcollision_handler(L, arg, udp) (collision_handler_t*)optxxx((L), (arg), (udp), COLLISION_HANDLER_MT)
 #define pushcollision_handler(L, handle) pushxxx((L), (void*)(handle))
@@ -276,6 +295,20 @@ static int Destroy(lua_State *L)            \
     return ud->destructor(L, ud);           \
     }
 
+#define GC_FUNC(xxx, getspace) /* __gc */                    \
+static int Gc(lua_State *L)                                 \
+    {                                                       \
+    ud_t *ud;                                               \
+    space_t *space;                                         \
+    void *handle = test##xxx(L, 1, &ud);                    \
+    if(!ud) return 0; /* already deleted */                 \
+    /* A finalizer can't fail, so instead of letting the    \
+     * destructor raise an error, wait for the async step */ \
+    if(IsValid(ud) && (space = getspace(handle)) != NULL)   \
+        waitspace(L, space);                                \
+    return ud->destructor(L, ud);                           \
+    }
+
 #define PARENT_FUNC(xxx)                    \
 static int Parent(lua_State *L)             \
     {                                       \
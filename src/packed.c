@@ -0,0 +1,964 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Stefano Trettel
+ *
+ * Software repository: MoonChipmunk, https://github.com/stetre/moonchipmunk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+#if defined(LINUX)
+#include <pthread.h>
+#endif
+
+/*------------------------------------------------------------------------------*
+ | Byte buffers                                                                 |
+ *------------------------------------------------------------------------------*/
+
+/* A buffer is just a full userdata whose memory area is the buffer content.
+ * It is meant to be filled by functions such as space:export_bodies() and to be
+ * passed to other libraries (e.g. for a GL buffer upload) by pointer or as string.
+ */
+
+void *testbuffer(lua_State *L, int arg, size_t *size)
+    {
+    void *ptr = luaL_testudata(L, arg, BUFFER_MT);
+    if(ptr && size) *size = lua_rawlen(L, arg);
+    return ptr;
+    }
+
+void *checkbuffer(lua_State *L, int arg, size_t *size)
+    {
+    void *ptr = testbuffer(L, arg, size);
+    if(!ptr) argerror(L, arg, ERR_TYPE);
+    return ptr;
+    }
+
+const void *checkdata(lua_State *L, int arg, size_t *size)
+/* Checks for input data, passed either as a binary string or as a buffer */
+    {
+    if(lua_type(L, arg) == LUA_TSTRING)
+        return lua_tolstring(L, arg, size);
+    return checkbuffer(L, arg, size);
+    }
+
+static int Buffer(lua_State *L)
+    {
+    char *ptr;
+    size_t size;
+    const char *data = NULL;
+    if(lua_type(L, 1) == LUA_TSTRING)
+        data = lua_tolstring(L, 1, &size);
+    else
+        size = (size_t)luaL_checkinteger(L, 1);
+    if(size == 0) return argerror(L, 1, ERR_LENGTH);
+    ptr = (char*)lua_newuserdata(L, size);
+    if(data) memcpy(ptr, data, size); else memset(ptr, 0, size);
+    luaL_setmetatable(L, BUFFER_MT);
+    return 1;
+    }
+
+static int BufferSize(lua_State *L)
+    {
+    size_t size;
+    (void)checkbuffer(L, 1, &size);
+    lua_pushinteger(L, size);
+    return 1;
+    }
+
+static size_t checkoffset(lua_State *L, int arg, size_t size)
+    {
+    lua_Integer offset = luaL_optinteger(L, arg, 0);
+    if(offset < 0 || (size_t)offset > size) argerror(L, arg, ERR_BOUNDARIES);
+    return (size_t)offset;
+    }
+
+static int BufferPtr(lua_State *L)
+    {
+    size_t size;
+    char *ptr = (char*)checkbuffer(L, 1, &size);
+    size_t offset = checkoffset(L, 2, size);
+    lua_pushlightuserdata(L, ptr + offset);
+    return 1;
+    }
+
+static int BufferRead(lua_State *L)
+    {
+    size_t size, len;
+    char *ptr = (char*)checkbuffer(L, 1, &size);
+    size_t offset = checkoffset(L, 2, size);
+    len = (size_t)luaL_optinteger(L, 3, size - offset);
+    if(len > size - offset) return argerror(L, 3, ERR_BOUNDARIES);
+    lua_pushlstring(L, ptr + offset, len);
+    return 1;
+    }
+
+static int BufferWrite(lua_State *L)
+    {
+    size_t size, len;
+    char *ptr = (char*)checkbuffer(L, 1, &size);
+    const char *data = luaL_checklstring(L, 2, &len);
+    size_t offset = checkoffset(L, 3, size);
+    if(len > size - offset) return argerror(L, 2, ERR_LENGTH);
+    memcpy(ptr + offset, data, len);
+    return 0;
+    }
+
+static const struct luaL_Reg BufferMethods[] =
+    {
+        { "size", BufferSize },
+        { "ptr", BufferPtr },
+        { "read", BufferRead },
+        { "write", BufferWrite },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg BufferMetaMethods[] =
+    {
+        { "__len", BufferSize },
+        { NULL, NULL } /* sentinel */
+    };
+
+/*------------------------------------------------------------------------------*
+ | Packed body states                                                           |
+ *------------------------------------------------------------------------------*/
+
+/* The bodies states are packed as arrays of floats or doubles, with components
+ * in the order id, x, y, angle, vx, vy, w (only those selected by the fields flags).
+ * In the AoS layout there is one record per body, while in the SoA layout there
+ * is one array per component, each with one element per body.
+ * The id is the body's serial number (see body:get_id()), which identifies the body
+ * across exports even if their order changes (it is ignored at import).
+ */
+
+enum { ID, PX, PY, ANGLE, VX, VY, W, NCOMPONENTS };
+
+typedef struct {
+    int count;
+    body_t **bodies;
+} bodies_t;
+
+static void countbody(body_t *body, void *data)
+    { ((bodies_t*)data)->count++; (void)body; }
+
+static void collectbody(body_t *body, void *data)
+    { bodies_t *b = (bodies_t*)data; b->bodies[b->count++] = body; }
+
+static void checkbodies(lua_State *L, int arg, space_t *space, bodies_t *b)
+/* Gets the list of bodies at arg or, if arg is none or nil, all the bodies in
+ * the space (in the same order as space:each_body()).
+ * The list is Malloc'd and must be Free'd by the caller. */
+    {
+    int err;
+    b->count = 0;
+    b->bodies = NULL;
+    if(lua_isnoneornil(L, arg))
+        {
+        cpSpaceEachBody(space, countbody, b);
+        if(b->count == 0) return;
+        b->bodies = (body_t**)Malloc(L, b->count*sizeof(body_t*));
+        b->count = 0;
+        cpSpaceEachBody(space, collectbody, b);
+        return;
+        }
+    b->bodies = checkbodylist(L, arg, &b->count, &err);
+    if(err == ERR_EMPTY) return;
+    if(err) argerror(L, arg, err);
+    }
+
+static int components(int fields, int *comp)
+/* Fills comp[] with the components selected by fields, and returns their number */
+    {
+    int n = 0;
+    if(fields & BODY_FIELD_ID) comp[n++] = ID;
+    if(fields & BODY_FIELD_POSITION) { comp[n++] = PX; comp[n++] = PY; }
+    if(fields & BODY_FIELD_ANGLE) comp[n++] = ANGLE;
+    if(fields & BODY_FIELD_VELOCITY) { comp[n++] = VX; comp[n++] = VY; }
+    if(fields & BODY_FIELD_ANGULAR_VELOCITY) comp[n++] = W;
+    return n;
+    }
+
+#define INDEX(layout, count, ncomp, i, j) /* index of component j of body i */ \
+    ((layout) == LAYOUT_AOS ? (size_t)(i)*(ncomp) + (j) : (size_t)(j)*(count) + (i))
+
+static double bodyid(lua_State *L, body_t *body)
+/* Returns the serial number of the body, or 0 if it is not bound to a userdata */
+    {
+    ud_t *ud = userdata(L, body);
+    return ud ? (double)ud->serial : 0;
+    }
+
+static void getstate(body_t *body, double *v)
+/* Gets all the components of the body state, but the id, in v[NCOMPONENTS] */
+    {
+    vec_t p = cpBodyGetPosition(body);
+    vec_t vel = cpBodyGetVelocity(body);
+    v[ID] = 0;
+    v[PX] = p.x; v[PY] = p.y;
+    v[ANGLE] = cpBodyGetAngle(body);
+    v[VX] = vel.x; v[VY] = vel.y;
+    v[W] = cpBodyGetAngularVelocity(body);
+    }
+
+static void packstate(const double *v, int i, int count, int *comp, int ncomp, int format, int layout, void *dst)
+/* Packs the selected components of v[NCOMPONENTS] as the state of body i of count */
+    {
+    int j;
+    if(format == FORMAT_FLOAT)
+        for(j = 0; j < ncomp; j++)
+            ((float*)dst)[INDEX(layout, count, ncomp, i, j)] = (float)v[comp[j]];
+    else
+        for(j = 0; j < ncomp; j++)
+            ((double*)dst)[INDEX(layout, count, ncomp, i, j)] = v[comp[j]];
+    }
+
+static void packbodies(lua_State *L, const bodies_t *b, int *comp, int ncomp, int format, int layout, void *dst)
+    {
+    int i;
+    double v[NCOMPONENTS];
+    for(i = 0; i < b->count; i++)
+        {
+        getstate(b->bodies[i], v);
+        if(comp[0] == ID) v[ID] = bodyid(L, b->bodies[i]);
+        packstate(v, i, b->count, comp, ncomp, format, layout, dst);
+        }
+    }
+
+static void unpackbodies(const bodies_t *b, int *comp, int ncomp, int format, int layout, const void *src)
+    {
+    int i, j;
+    double v[NCOMPONENTS];
+    unsigned int set;
+    body_t *body;
+    for(i = 0; i < b->count; i++)
+        {
+        body = b->bodies[i];
+        set = 0;
+        for(j = 0; j < ncomp; j++)
+            {
+            v[comp[j]] = (format == FORMAT_FLOAT) ?
+                    ((const float*)src)[INDEX(layout, b->count, ncomp, i, j)] :
+                    ((const double*)src)[INDEX(layout, b->count, ncomp, i, j)];
+            set |= 1 << comp[j];
+            }
+        if(set & (1 << PX)) cpBodySetPosition(body, cpv(v[PX], v[PY]));
+        if(set & (1 << ANGLE)) cpBodySetAngle(body, v[ANGLE]);
+        if(set & (1 << VX)) cpBodySetVelocity(body, cpv(v[VX], v[VY]));
+        if(set & (1 << W)) cpBodySetAngularVelocity(body, v[W]);
+        }
+    }
+
+static int ExportBodies(lua_State *L)
+    {
+    bodies_t b;
+    int comp[NCOMPONENTS], ncomp;
+    size_t size, bufsize;
+    void *dst = NULL;
+    luaL_Buffer buf;
+    space_t *space = checkspace(L, 1, NULL);
+    int fields = checkflags(L, 3);
+    int format = optformat(L, 4, FORMAT_FLOAT);
+    int layout = optlayout(L, 5, LAYOUT_AOS);
+    if(!lua_isnoneornil(L, 2)) dst = checkbuffer(L, 2, &bufsize);
+    if((ncomp = components(fields, comp)) == 0) return argerror(L, 3, ERR_VALUE);
+    checkbodies(L, 6, space, &b);
+    size = (size_t)b.count * ncomp * (format == FORMAT_FLOAT ? sizeof(float) : sizeof(double));
+    if(dst)
+        {
+        if(size > bufsize)
+            { if(b.bodies) Free(L, b.bodies); return argerror(L, 2, ERR_LENGTH); }
+        packbodies(L, &b, comp, ncomp, format, layout, dst);
+        if(b.bodies) Free(L, b.bodies);
+        lua_pushinteger(L, b.count);
+        return 1;
+        }
+    dst = luaL_buffinitsize(L, &buf, size);
+    packbodies(L, &b, comp, ncomp, format, layout, dst);
+    if(b.bodies) Free(L, b.bodies);
+    luaL_pushresultsize(&buf, size);
+    lua_pushinteger(L, b.count);
+    return 2;
+    }
+
+static int ImportBodies(lua_State *L)
+    {
+    int i;
+    bodies_t b;
+    int comp[NCOMPONENTS], ncomp;
+    size_t size, datasize;
+    space_t *space = checkspace(L, 1, NULL);
+    const void *src = checkdata(L, 2, &datasize);
+    int fields = checkflags(L, 3);
+    int format = optformat(L, 4, FORMAT_FLOAT);
+    int layout = optlayout(L, 5, LAYOUT_AOS);
+    if((ncomp = components(fields, comp)) == 0) return argerror(L, 3, ERR_VALUE);
+    if(cpSpaceIsLocked(space)) return failure(L, ERR_OPERATION);
+    checkbodies(L, 6, space, &b);
+#define CLEANUP do { if(b.bodies) Free(L, b.bodies); } while(0)
+    for(i = 0; i < b.count; i++)
+        {
+        if(cpBodyGetSpace(b.bodies[i]) != space)
+            { CLEANUP; return argerror(L, 6, ERR_VALUE); }
+        }
+    size = (size_t)b.count * ncomp * (format == FORMAT_FLOAT ? sizeof(float) : sizeof(double));
+    if(size > datasize)
+        { CLEANUP; return argerror(L, 2, ERR_LENGTH); }
+    unpackbodies(&b, comp, ncomp, format, layout, src);
+    /* update the shapes' bounding boxes in the spatial index, once per body */
+    if(fields & (BODY_FIELD_POSITION | BODY_FIELD_ANGLE))
+        for(i = 0; i < b.count; i++) cpSpaceReindexShapesForBody(space, b.bodies[i]);
+    CLEANUP;
+#undef CLEANUP
+    lua_pushinteger(L, b.count);
+    return 1;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Fixed-step driver                                                            |
+ *------------------------------------------------------------------------------*/
+
+/* space:advance() accumulates the real elapsed time, and consumes it in fixed steps.
+ * Before the last step of each advance, the positions and angles of the bodies are saved
+ * in a hash table keyed by the serial number of the body, so that after it the rendering
+ * state can be interpolated between the saved (previous) and the current state with alpha =
+ * the fraction of a step left in the accumulator. Serial numbers are never reused, so a body
+ * allocated at the address of one freed in the meanwhile (e.g. by space:clear()) does not find
+ * its state. Bodies not bound to a userdata are not interpolated.
+ */
+
+typedef struct {
+    uint64_t serial; /* serial number of the body (see newuserdata()), 0 = free slot */
+    double x, y, angle;
+} prev_t;
+
+struct moonchipmunk_stepper_s {
+    double dt; /* fixed time step */
+    int maxsteps; /* max no. of steps per advance (excess time is dropped) */
+    double accumulator; /* time not yet simulated */
+    double alpha;
+    size_t size; /* no. of slots in prev[] (a power of 2, or 0) */
+    prev_t *prev; /* hash table of previous states */
+};
+
+#define DEFAULT_MAXSTEPS 5
+
+void freestepper(lua_State *L, stepper_t *stepper)
+    {
+    if(!stepper) return;
+    if(stepper->prev) Free(L, stepper->prev);
+    Free(L, stepper);
+    }
+
+static size_t hashserial(uint64_t serial, size_t size)
+    {
+    uint64_t h = serial;
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL; h ^= h >> 33;
+    return (size_t)h & (size - 1);
+    }
+
+typedef struct {
+    lua_State *L;
+    stepper_t *stepper;
+} saving_t;
+
+static void savebody(body_t *body, void *data)
+    {
+    size_t i;
+    vec_t p;
+    saving_t *saving = (saving_t*)data;
+    stepper_t *stepper = saving->stepper;
+    ud_t *ud = userdata(saving->L, body);
+    if(!ud) return;
+    i = hashserial(ud->serial, stepper->size);
+    p = cpBodyGetPosition(body);
+    while(stepper->prev[i].serial) i = (i + 1) & (stepper->size - 1);
+    stepper->prev[i].serial = ud->serial;
+    stepper->prev[i].x = p.x;
+    stepper->prev[i].y = p.y;
+    stepper->prev[i].angle = cpBodyGetAngle(body);
+    }
+
+static void savestates(lua_State *L, stepper_t *stepper, space_t *space)
+    {
+    size_t size = 16;
+    bodies_t b;
+    saving_t saving;
+    b.count = 0;
+    cpSpaceEachBody(space, countbody, &b);
+    while(size < 2*(size_t)b.count) size *= 2; /* load factor <= 0.5 */
+    if(size != stepper->size)
+        {
+        if(stepper->prev) Free(L, stepper->prev);
+        stepper->prev = (prev_t*)Malloc(L, size*sizeof(prev_t));
+        stepper->size = size;
+        }
+    else
+        memset(stepper->prev, 0, size*sizeof(prev_t));
+    saving.L = L;
+    saving.stepper = stepper;
+    cpSpaceEachBody(space, savebody, &saving);
+    }
+
+static const prev_t *prevstate(lua_State *L, const stepper_t *stepper, body_t *body)
+    {
+    size_t i;
+    ud_t *ud;
+    if(stepper->size == 0 || (ud = userdata(L, body)) == NULL) return NULL;
+    i = hashserial(ud->serial, stepper->size);
+    while(stepper->prev[i].serial)
+        {
+        if(stepper->prev[i].serial == ud->serial) return &stepper->prev[i];
+        i = (i + 1) & (stepper->size - 1);
+        }
+    return NULL;
+    }
+
+static void packinterpolated(lua_State *L, const stepper_t *stepper, const bodies_t *b, int format, int layout, void *dst)
+    {
+    int i, j;
+    double v[3];
+    double alpha = stepper->alpha;
+    const prev_t *prev;
+    vec_t p;
+    for(i = 0; i < b->count; i++)
+        {
+        p = cpBodyGetPosition(b->bodies[i]);
+        v[0] = p.x; v[1] = p.y;
+        v[2] = cpBodyGetAngle(b->bodies[i]);
+        if((prev = prevstate(L, stepper, b->bodies[i])) != NULL)
+            {
+            v[0] = prev->x + alpha*(v[0] - prev->x);
+            v[1] = prev->y + alpha*(v[1] - prev->y);
+            v[2] = prev->angle + alpha*(v[2] - prev->angle);
+            }
+        if(format == FORMAT_FLOAT)
+            for(j = 0; j < 3; j++)
+                ((float*)dst)[INDEX(layout, b->count, 3, i, j)] = (float)v[j];
+        else
+            for(j = 0; j < 3; j++)
+                ((double*)dst)[INDEX(layout, b->count, 3, i, j)] = v[j];
+        }
+    }
+
+static stepper_t *getstepper(lua_State *L, ud_t *ud)
+    {
+    stepper_t **stepper = spacestepper(ud);
+    if(!*stepper)
+        {
+        *stepper = (stepper_t*)Malloc(L, sizeof(stepper_t));
+        (*stepper)->dt = 1.0/60.0;
+        (*stepper)->maxsteps = DEFAULT_MAXSTEPS;
+        }
+    return *stepper;
+    }
+
+static int SetFixedStep(lua_State *L)
+    {
+    ud_t *ud;
+    stepper_t *stepper;
+    double dt;
+    int maxsteps;
+    (void)checkspace(L, 1, &ud);
+    dt = luaL_checknumber(L, 2);
+    maxsteps = luaL_optinteger(L, 3, DEFAULT_MAXSTEPS);
+    if(dt <= 0) return argerror(L, 2, ERR_VALUE);
+    if(maxsteps < 1) return argerror(L, 3, ERR_VALUE);
+    stepper = getstepper(L, ud);
+    stepper->dt = dt;
+    stepper->maxsteps = maxsteps;
+    stepper->accumulator = 0;
+    stepper->alpha = 0;
+    return 0;
+    }
+
+static int GetFixedStep(lua_State *L)
+    {
+    ud_t *ud;
+    stepper_t *stepper;
+    (void)checkspace(L, 1, &ud);
+    stepper = getstepper(L, ud);
+    lua_pushnumber(L, stepper->dt);
+    lua_pushinteger(L, stepper->maxsteps);
+    return 2;
+    }
+
+static int Advance(lua_State *L)
+    {
+    ud_t *ud;
+    int i, n;
+    double nwhole;
+    bodies_t b;
+    size_t size, bufsize;
+    void *dst = NULL;
+    stepper_t *stepper;
+    space_t *space = checkspace(L, 1, &ud);
+    double elapsed = luaL_checknumber(L, 2);
+    int format = optformat(L, 4, FORMAT_FLOAT);
+    int layout = optlayout(L, 5, LAYOUT_AOS);
+    if(elapsed < 0) return argerror(L, 2, ERR_VALUE);
+    if(!lua_isnoneornil(L, 3)) dst = checkbuffer(L, 3, &bufsize);
+    if(cpSpaceIsLocked(space)) return failure(L, ERR_OPERATION);
+    stepper = getstepper(L, ud);
+    stepper->accumulator += elapsed;
+    nwhole = floor(stepper->accumulator/stepper->dt);
+    n = nwhole < stepper->maxsteps ? (int)nwhole : stepper->maxsteps;
+    stepper->accumulator -= nwhole*stepper->dt; /* drop the steps beyond maxsteps */
+    if(stepper->accumulator < 0) stepper->accumulator = 0; /* rounding */
+    for(i = 0; i < n; i++)
+        {
+        if(i == n-1) savestates(L, stepper, space);
+        stepspace(ud, stepper->dt);
+        }
+    stepper->alpha = stepper->accumulator/stepper->dt;
+    lua_pushinteger(L, n);
+    lua_pushnumber(L, stepper->alpha);
+    if(!dst) return 2;
+    checkbodies(L, 6, space, &b);
+    size = (size_t)b.count * 3 * (format == FORMAT_FLOAT ? sizeof(float) : sizeof(double));
+    if(size > bufsize)
+        { if(b.bodies) Free(L, b.bodies); return argerror(L, 3, ERR_LENGTH); }
+    packinterpolated(L, stepper, &b, format, layout, dst);
+    if(b.bodies) Free(L, b.bodies);
+    lua_pushinteger(L, b.count);
+    return 3;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Async stepping                                                               |
+ *------------------------------------------------------------------------------*/
+
+/* space:step_async() executes a step in a worker thread (one per space, created at the
+ * first call) and returns immediately, so that the calling thread can do other work
+ * until space:wait(). The step must not call Lua, so it is refused if the space has any
+ * callback that may do so (Lua functions, but also break forces and the native collision
+ * handler features, which use the Lua state). Until wait() the script must not access the
+ * space or its objects, but it can read the bodies states with space:get_async_state().
+ * These are double buffered: the worker fills the back snapshot at the end of the step,
+ * and wait() swaps it with the front one, which is the only one read by the script.
+ * Async steps are not traced nor included in the step statistics, because the context
+ * where these are collected is shared with the calling thread.
+ */
+
+typedef struct {
+    double *states; /* NCOMPONENTS doubles per body */
+    body_t **bodies; /* the bodies (used only to resolve their ids) */
+    int count; /* no. of bodies */
+    int size; /* no. of bodies that fit in states[] */
+} snapshot_t;
+
+struct moonchipmunk_async_s {
+    space_t *space;
+    int hasty;
+    double dt;
+    int busy; /* a step is in progress (accessed by the calling thread only) */
+    int front; /* index of the front snapshot */
+    snapshot_t snap[2];
+#if defined(LINUX)
+    int hasthread;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t start; /* signaled when a step is requested (or at quit) */
+    pthread_cond_t done; /* signaled when the step is done */
+    int pending; /* 1 from the request of a step until it is done */
+    int quit;
+#endif
+};
+
+static void snapbody(body_t *body, void *data)
+    {
+    snapshot_t *s = (snapshot_t*)data;
+    if(s->count >= s->size) return;
+    s->bodies[s->count] = body;
+    getstate(body, s->states + (size_t)(s->count++)*NCOMPONENTS);
+    }
+
+static void reservesnapshot(lua_State *L, snapshot_t *s, space_t *space)
+/* Makes room in the snapshot for all the bodies in the space */
+    {
+    bodies_t b;
+    b.count = 0;
+    cpSpaceEachBody(space, countbody, &b);
+    if(b.count <= s->size) return;
+    if(s->states) Free(L, s->states);
+    if(s->bodies) Free(L, s->bodies);
+    s->states = (double*)Malloc(L, (size_t)b.count*NCOMPONENTS*sizeof(double));
+    s->bodies = (body_t**)Malloc(L, (size_t)b.count*sizeof(body_t*));
+    s->size = b.count;
+    }
+
+static void takesnapshot(snapshot_t *s, space_t *space)
+    {
+    s->count = 0;
+    cpSpaceEachBody(space, snapbody, s);
+    }
+
+static void resolveids(lua_State *L, snapshot_t *s)
+/* Sets the ids in a snapshot taken by the worker thread (which can't access the registry) */
+    {
+    int i;
+    for(i = 0; i < s->count; i++)
+        s->states[(size_t)i*NCOMPONENTS + ID] = bodyid(L, s->bodies[i]);
+    }
+
+static void asyncstep(async_t *async)
+/* Executes the step and fills the back snapshot (without touching the Lua state) */
+    {
+    if(async->hasty)
+        cpHastySpaceStep(async->space, async->dt);
+    else
+        cpSpaceStep(async->space, async->dt);
+    takesnapshot(&async->snap[!async->front], async->space);
+    }
+
+#if defined(LINUX)
+
+static void *AsyncThread(void *arg)
+    {
+    async_t *async = (async_t*)arg;
+    pthread_mutex_lock(&async->mutex);
+    for(;;)
+        {
+        while(!async->pending && !async->quit)
+            pthread_cond_wait(&async->start, &async->mutex);
+        if(async->quit) break;
+        pthread_mutex_unlock(&async->mutex);
+        asyncstep(async);
+        pthread_mutex_lock(&async->mutex);
+        async->pending = 0;
+        pthread_cond_signal(&async->done);
+        }
+    pthread_mutex_unlock(&async->mutex);
+    return NULL;
+    }
+
+static int startthread(async_t *async)
+/* Creates the worker thread, if not already done. Returns 0 on success */
+    {
+    if(async->hasthread) return 0;
+    if(pthread_create(&async->thread, NULL, AsyncThread, async) != 0) return -1;
+    async->hasthread = 1;
+    return 0;
+    }
+
+static void startstep(async_t *async)
+    {
+    pthread_mutex_lock(&async->mutex);
+    async->pending = 1;
+    pthread_cond_signal(&async->start);
+    pthread_mutex_unlock(&async->mutex);
+    }
+
+static void waitstep(async_t *async)
+    {
+    pthread_mutex_lock(&async->mutex);
+    while(async->pending)
+        pthread_cond_wait(&async->done, &async->mutex);
+    pthread_mutex_unlock(&async->mutex);
+    }
+
+static void initthread(async_t *async)
+    {
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->start, NULL);
+    pthread_cond_init(&async->done, NULL);
+    }
+
+static void stopthread(async_t *async)
+    {
+    waitstep(async);
+    if(async->hasthread)
+        {
+        pthread_mutex_lock(&async->mutex);
+        async->quit = 1;
+        pthread_cond_signal(&async->start);
+        pthread_mutex_unlock(&async->mutex);
+        pthread_join(async->thread, NULL);
+        }
+    pthread_cond_destroy(&async->start);
+    pthread_cond_destroy(&async->done);
+    pthread_mutex_destroy(&async->mutex);
+    }
+
+#else /* no pthreads: the step is executed in the calling thread by step_async() */
+
+static int startthread(async_t *async)
+    { (void)async; return 0; }
+
+static void startstep(async_t *async)
+    { asyncstep(async); }
+
+static void waitstep(async_t *async)
+    { (void)async; }
+
+static void initthread(async_t *async)
+    { (void)async; }
+
+static void stopthread(async_t *async)
+    { (void)async; }
+
+#endif
+
+void freeasync(lua_State *L, async_t *async)
+    {
+    int i;
+    if(!async) return;
+    stopthread(async); /* waits for the step in progress, if any */
+    if(async->busy) spacectx(async->space)->asyncsteps--;
+    for(i = 0; i < 2; i++)
+        {
+        if(async->snap[i].states) Free(L, async->snap[i].states);
+        if(async->snap[i].bodies) Free(L, async->snap[i].bodies);
+        }
+    Free(L, async);
+    }
+
+int asyncbusy(ud_t *ud)
+/* Returns 1 if an async step of the space is in progress */
+    {
+    async_t *async;
+    if(!ud->info) return 0; /* the space is being freed (see freespace()) */
+    async = *spaceasync(ud);
+    return async && async->busy;
+    }
+
+int spacebusy(lua_State *L, space_t *space)
+    {
+    ud_t *ud;
+    if(spacectx(space)->asyncsteps == 0) return 0; /* no need to look up the space */
+    ud = userdata(L, space);
+    return ud && asyncbusy(ud);
+    }
+
+space_t *checkidlespace(lua_State *L, int arg, ud_t **udp)
+/* Checks for a space that is not executing an async step. This is what checkspace()
+ * does, so that no method can access a space while the worker thread is stepping it,
+ * except those that explicitly use checkanyspace() */
+    {
+    ud_t *ud;
+    space_t *space = checkanyspace(L, arg, &ud);
+    if(asyncbusy(ud)) failure(L, ERR_OPERATION);
+    if(udp) *udp = ud;
+    return space;
+    }
+
+/* The same goes for the objects in the space, which the worker thread may be accessing
+ * as well (this is what checkbody(), checkshape(), etc. do): */
+
+body_t *checkidlebody(lua_State *L, int arg, ud_t **udp)
+    {
+    body_t *body = checkanybody(L, arg, udp);
+    space_t *space = cpBodyGetSpace(body);
+    if(space && spacebusy(L, space)) failure(L, ERR_OPERATION);
+    return body;
+    }
+
+shape_t *checkidleshape(lua_State *L, int arg, ud_t **udp, const char *mt)
+    {
+    shape_t *shape = (shape_t*)checkxxx(L, arg, udp, mt);
+    space_t *space = cpShapeGetSpace(shape);
+    if(space && spacebusy(L, space)) failure(L, ERR_OPERATION);
+    return shape;
+    }
+
+constraint_t *checkidleconstraint(lua_State *L, int arg, ud_t **udp, const char *mt)
+    {
+    constraint_t *constraint = (constraint_t*)checkxxx(L, arg, udp, mt);
+    space_t *space = cpConstraintGetSpace(constraint);
+    if(space && spacebusy(L, space)) failure(L, ERR_OPERATION);
+    return constraint;
+    }
+
+collision_handler_t *checkidlecollision_handler(lua_State *L, int arg, ud_t **udp)
+    {
+    ud_t *ud;
+    collision_handler_t *handler = (collision_handler_t*)checkxxx(L, arg, &ud, COLLISION_HANDLER_MT);
+    if(ud->parent_ud && asyncbusy(ud->parent_ud)) failure(L, ERR_OPERATION);
+    if(udp) *udp = ud;
+    return handler;
+    }
+
+static async_t *getasync(lua_State *L, ud_t *ud, space_t *space)
+    {
+    async_t **async = spaceasync(ud);
+    if(!*async)
+        {
+        *async = (async_t*)Malloc(L, sizeof(async_t));
+        (*async)->space = space;
+        initthread(*async);
+        }
+    return *async;
+    }
+
+static void bodycalls(body_t *body, void *data)
+    { if(bodycallslua(body)) *(int*)data = 1; }
+
+static void constraintcalls(constraint_t *constraint, void *data)
+    { if(constraintcallslua(constraint)) *(int*)data = 1; }
+
+static int callslua(ud_t *ud, space_t *space)
+/* Returns 1 if stepping the space may call Lua */
+    {
+    int calls = 0;
+    ud_t *child;
+    /* post-step callbacks added by the script between steps run at the end of the next one */
+    if(space->postStepCallbacks->num > 0) return 1;
+    for(child = ud->first_child; child != NULL; child = child->next_sibling)
+        {
+        if(strcmp(child->mt, COLLISION_HANDLER_MT) == 0 &&
+                handlercallslua((collision_handler_t*)child->handle))
+            return 1;
+        }
+    cpSpaceEachBody(space, bodycalls, &calls);
+    if(!calls) cpSpaceEachConstraint(space, constraintcalls, &calls);
+    return calls;
+    }
+
+static int StepAsync(lua_State *L)
+    {
+    ud_t *ud;
+    async_t *async;
+    snapshot_t *front;
+    space_t *space = checkspace(L, 1, &ud);
+    double dt = luaL_checknumber(L, 2);
+    if(cpSpaceIsLocked(space) || callslua(ud, space))
+        return failure(L, ERR_OPERATION);
+    async = getasync(L, ud, space);
+    if(startthread(async) != 0) return failure(L, ERR_OPERATION);
+    front = &async->snap[async->front];
+    if(!front->states)
+        { /* first step: the front snapshot is taken here */
+        reservesnapshot(L, front, space);
+        takesnapshot(front, space);
+        resolveids(L, front);
+        }
+    reservesnapshot(L, &async->snap[!async->front], space);
+    async->hasty = IsHasty(ud);
+    async->dt = dt;
+    async->busy = 1;
+    spacectx(space)->asyncsteps++;
+    startstep(async);
+    return 0;
+    }
+
+static void finishstep(lua_State *L, async_t *async)
+/* Waits for the step in progress to complete, and swaps the snapshots */
+    {
+    waitstep(async);
+    async->busy = 0;
+    spacectx(async->space)->asyncsteps--;
+    async->front = !async->front;
+    resolveids(L, &async->snap[async->front]);
+    }
+
+void waitspace(lua_State *L, space_t *space)
+/* Completes the async step of the space, if one is in progress, as wait() does
+ * (used by the __gc metamethods of the objects in the space, see GC_FUNC) */
+    {
+    ud_t *ud;
+    if(spacectx(space)->asyncsteps == 0) return;
+    ud = userdata(L, space);
+    if(ud && asyncbusy(ud)) finishstep(L, *spaceasync(ud));
+    }
+
+static int Wait(lua_State *L)
+    {
+    ud_t *ud;
+    async_t *async;
+    double t0;
+    ctx_t *ctx = getctx(L);
+    (void)checkanyspace(L, 1, &ud);
+    async = *spaceasync(ud);
+    if(!async || !async->busy)
+        { lua_pushboolean(L, 0); return 1; }
+    t0 = tracebegin(ctx);
+    finishstep(L, async);
+    traceend(ctx, "step", "wait", t0);
+    lua_pushboolean(L, 1);
+    return 1;
+    }
+
+static int GetAsyncState(lua_State *L)
+    {
+    ud_t *ud;
+    int i, comp[NCOMPONENTS], ncomp;
+    size_t size, bufsize;
+    void *dst = NULL;
+    luaL_Buffer buf;
+    async_t *async;
+    snapshot_t empty = { NULL, NULL, 0, 0 };
+    snapshot_t *s = &empty;
+    int fields, format, layout;
+    (void)checkanyspace(L, 1, &ud);
+    fields = checkflags(L, 3);
+    format = optformat(L, 4, FORMAT_FLOAT);
+    layout = optlayout(L, 5, LAYOUT_AOS);
+    if(!lua_isnoneornil(L, 2)) dst = checkbuffer(L, 2, &bufsize);
+    if((ncomp = components(fields, comp)) == 0) return argerror(L, 3, ERR_VALUE);
+    async = *spaceasync(ud);
+    if(async) s = &async->snap[async->front];
+    size = (size_t)s->count * ncomp * (format == FORMAT_FLOAT ? sizeof(float) : sizeof(double));
+    if(dst)
+        {
+        if(size > bufsize) return argerror(L, 2, ERR_LENGTH);
+        }
+    else
+        dst = luaL_buffinitsize(L, &buf, size);
+    for(i = 0; i < s->count; i++)
+        packstate(s->states + (size_t)i*NCOMPONENTS, i, s->count, comp, ncomp, format, layout, dst);
+    if(lua_isnoneornil(L, 2))
+        {
+        luaL_pushresultsize(&buf, size);
+        lua_pushinteger(L, s->count);
+        return 2;
+        }
+    lua_pushinteger(L, s->count);
+    return 1;
+    }
+
+static const struct luaL_Reg SpaceMethods[] =
+    {
+        { "export_bodies", ExportBodies },
+        { "import_bodies", ImportBodies },
+        { "set_fixed_step", SetFixedStep },
+        { "get_fixed_step", GetFixedStep },
+        { "advance", Advance },
+        { "step_async", StepAsync },
+        { "wait", Wait },
+        { "get_async_state", GetAsyncState },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] =
+    {
+        { "buffer", Buffer },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonchipmunk_open_packed(lua_State *L)
+    {
+    luaL_newmetatable(L, BUFFER_MT);
+    luaL_setfuncs(L, BufferMetaMethods, 0);
+    luaL_newlib(L, BufferMethods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    udata_addmethods(L, SPACE_MT, SpaceMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
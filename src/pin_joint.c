@@ -29,7 +29,7 @@
 static int freepin_joint(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "pin_joint")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -64,6 +64,7 @@ SETDOUBLE(SetDist, cpPinJointSetDist, pin_joint)
 GETDOUBLE(GetDist, cpPinJointGetDist, pin_joint)
 
 DESTROY_FUNC(pin_joint)
+GC_FUNC(pin_joint, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -79,7 +80,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -29,13 +29,13 @@
 static int freepivot_joint(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "pivot_joint")) return 0;
     constraintdestroy(L, constraint);
     return 0;
     }
 
-static int newpivot_joint(lua_State *L, constraint_t *constraint)
+int newpivot_joint(lua_State *L, constraint_t *constraint)
     {
     ud_t *ud;
     ud = newuserdata(L, constraint, PIVOT_JOINT_MT, "pivot_joint");
@@ -70,6 +70,7 @@ GETVEC(GetAnchorA, cpPivotJointGetAnchorA, pivot_joint)
 GETVEC(GetAnchorB, cpPivotJointGetAnchorB, pivot_joint)
 
 DESTROY_FUNC(pivot_joint)
+GC_FUNC(pivot_joint, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -83,7 +84,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
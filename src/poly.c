@@ -28,7 +28,7 @@
 static int freepoly(lua_State *L, ud_t *ud)
     {
     shape_t *shape = (shape_t*)ud->handle;
-    if(!candestroyshape(shape, ud)) return 0;
+    if(!candestroyshape(L, shape, ud)) return 0;
     if(!freeuserdata(L, ud, "poly")) return 0;
     shapedestroy(L, (shape_t*)shape);
     return 0;
@@ -140,6 +140,7 @@ static int SetRadius(lua_State *L)
     }
 
 DESTROY_FUNC(poly)
+GC_FUNC(poly, cpShapeGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -154,7 +155,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
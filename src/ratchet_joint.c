@@ -29,7 +29,7 @@
 static int freeratchet_joint(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "ratchet_joint")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -62,6 +62,7 @@ GETDOUBLE(GetPhase, cpRatchetJointGetPhase, ratchet_joint)
 GETDOUBLE(GetRatchet, cpRatchetJointGetRatchet, ratchet_joint)
 
 DESTROY_FUNC(ratchet_joint)
+GC_FUNC(ratchet_joint, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -77,7 +78,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -0,0 +1,157 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Stefano Trettel
+ *
+ * Software repository: MoonChipmunk, https://github.com/stetre/moonchipmunk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/*------------------------------------------------------------------------------*
+ | Native records                                                               |
+ *------------------------------------------------------------------------------*/
+
+/* A records_t is a C array of fixed-size records of doubles, filled by native
+ * callbacks during a step (when Lua code should not be called), and drained by the
+ * script after the step with a single call.
+ * It is either a ring (with fixed capacity, where new records overwrite the oldest
+ * ones when full), or a growable array.
+ */
+
+void initrecords(records_t *r, size_t recsize, size_t capacity, int ring)
+    {
+    memset(r, 0, sizeof(records_t));
+    r->recsize = recsize;
+    r->capacity = capacity;
+    r->ring = ring;
+    }
+
+void freerecords(lua_State *L, records_t *r)
+    {
+    if(r->data) Free(L, r->data);
+    r->data = NULL;
+    r->first = r->count = r->lost = 0;
+    }
+
+void resizerecords(lua_State *L, records_t *r, size_t capacity)
+/* Changes the capacity (discarding any record) */
+    {
+    freerecords(L, r);
+    r->capacity = capacity;
+    }
+
+#define RECORD(r, i) ((r)->data + (((r)->first + (i)) % (r)->capacity)*(r)->recsize)
+
+double *newrecord(lua_State *L, records_t *r)
+/* Returns a pointer to a new record, to be filled by the caller */
+    {
+    size_t i;
+    double *data;
+    if(!r->data)
+        r->data = (double*)Malloc(L, r->capacity*r->recsize*sizeof(double));
+    if(r->count == r->capacity)
+        {
+        if(r->ring) /* overwrite the oldest */
+            {
+            r->first = (r->first + 1) % r->capacity;
+            r->lost++;
+            return RECORD(r, r->count - 1);
+            }
+        data = (double*)Malloc(L, 2*r->capacity*r->recsize*sizeof(double));
+        for(i = 0; i < r->count; i++)
+            memcpy(data + i*r->recsize, RECORD(r, i), r->recsize*sizeof(double));
+        Free(L, r->data);
+        r->data = data;
+        r->first = 0;
+        r->capacity *= 2;
+        }
+    r->count++;
+    return RECORD(r, r->count - 1);
+    }
+
+static void droprecords(records_t *r, size_t n)
+/* Removes the n oldest records */
+    {
+    r->count -= n;
+    r->first = r->count == 0 ? 0 : (r->first + n) % r->capacity;
+    }
+
+int drainrecords(lua_State *L, int arg, records_t *r, const char *fields[], int nint)
+/* Removes the records and passes them to the script, depending on the argument at arg:
+ * - table: in one array per field (t[fields[i]]), the first nint fields as integers,
+ * - buffer: as many records as fit in it (the others are left for the next call),
+ * - none or nil: as a binary string.
+ * Returns the no. of records drained, preceded by the string in the last case, and
+ * followed by the no. of records lost (overwritten) since the last drain.
+ */
+    {
+    size_t i, j, n, size;
+    double *dst, *rec;
+    luaL_Buffer b;
+    int tostring = lua_isnoneornil(L, arg);
+    if(lua_istable(L, arg))
+        {
+        lua_settop(L, arg);
+        n = r->count;
+        for(j = 0; j < r->recsize; j++)
+            {
+            if(lua_getfield(L, arg, fields[j]) != LUA_TTABLE)
+                {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushvalue(L, -1);
+                lua_setfield(L, arg, fields[j]);
+                }
+            for(i = 0; i < n; i++)
+                {
+                rec = RECORD(r, i);
+                if((int)j < nint) lua_pushinteger(L, (lua_Integer)rec[j]);
+                else lua_pushnumber(L, rec[j]);
+                lua_rawseti(L, -2, i+1);
+                }
+            lua_pop(L, 1);
+            }
+        }
+    else
+        {
+        if(tostring)
+            {
+            n = r->count;
+            dst = (double*)luaL_buffinitsize(L, &b, n*r->recsize*sizeof(double));
+            }
+        else
+            {
+            dst = (double*)checkbuffer(L, arg, &size);
+            n = size / (r->recsize*sizeof(double));
+            if(n > r->count) n = r->count;
+            }
+        for(i = 0; i < n; i++)
+            memcpy(dst + i*r->recsize, RECORD(r, i), r->recsize*sizeof(double));
+        if(tostring)
+            luaL_pushresultsize(&b, n*r->recsize*sizeof(double));
+        }
+    droprecords(r, n);
+    lua_pushinteger(L, n);
+    lua_pushinteger(L, r->lost);
+    r->lost = 0;
+    return tostring ? 3 : 2;
+    }
+
@@ -29,7 +29,7 @@
 static int freerotary_limit_joint(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "rotary_limit_joint")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -60,6 +60,7 @@ GETDOUBLE(GetMin, cpRotaryLimitJointGetMin, rotary_limit_joint)
 GETDOUBLE(GetMax, cpRotaryLimitJointGetMax, rotary_limit_joint)
 
 DESTROY_FUNC(rotary_limit_joint)
+GC_FUNC(rotary_limit_joint, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -73,7 +74,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
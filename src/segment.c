@@ -28,7 +28,7 @@
 static int freesegment(lua_State *L, ud_t *ud)
     {
     shape_t *shape = (shape_t*)ud->handle;
-    if(!candestroyshape(shape, ud)) return 0;
+    if(!candestroyshape(L, shape, ud)) return 0;
     if(!freeuserdata(L, ud, "segment")) return 0;
     shapedestroy(L, (shape_t*)shape);
     return 0;
@@ -89,8 +89,8 @@ static int GetEndpoints(lua_State *L)
     shape_t *segment = checksegment(L, 1, NULL);
     vec_t a = cpSegmentShapeGetA(segment);
     vec_t b = cpSegmentShapeGetB(segment);
-    pushvec(L, &a);
-    pushvec(L, &b);
+    pushvecout(L, 2, &a);
+    pushvecout(L, 3, &b);
     return 2;
     }
 
@@ -108,7 +108,7 @@ static int GetNormal(lua_State *L)
     {
     shape_t *segment = checksegment(L, 1, NULL);
     vec_t n = cpSegmentShapeGetNormal(segment);
-    pushvec(L, &n);
+    pushvecout(L, 2, &n);
     return 1;
     }
 
@@ -129,6 +129,7 @@ static int SetRadius(lua_State *L)
     }
 
 DESTROY_FUNC(segment)
+GC_FUNC(segment, cpShapeGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -146,7 +147,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -25,11 +25,12 @@
 
 #include "internal.h"
 
-int candestroyshape(shape_t *shape, ud_t *ud)
+int candestroyshape(lua_State *L, shape_t *shape, ud_t *ud)
     {
     space_t *space;
     if(!IsValid(ud)) return 0; /* already destroyed */
     space = cpShapeGetSpace(shape);
+    if(space && spacebusy(L, space)) return failure(L, ERR_OPERATION); /* async step in progress */
     if(space && cpSpaceIsLocked(space)) return 0; /* leave it to post step callbacks */
     return 1;
     }
@@ -95,7 +96,7 @@ static int GetCenterOfGravity(lua_State *L)
     {
     shape_t *shape = checkshape(L, 1, NULL);
     vec_t pos = cpShapeGetCenterOfGravity(shape);
-    pushvec(L, &pos);
+    pushvecout(L, 2, &pos);
     return 1;
     }
 
@@ -112,7 +113,7 @@ static int GetSurfaceVelocity(lua_State *L)
     {
     shape_t *shape = checkshape(L, 1, NULL);
     vec_t vel = cpShapeGetSurfaceVelocity(shape);
-    pushvec(L, &vel);
+    pushvecout(L, 2, &vel);
     return 1;
     }
 
@@ -273,6 +274,7 @@ static int ShapeFilterNone(lua_State *L)
 RAW_FUNC(shape)
 PARENT_FUNC(shape)
 DESTROY_FUNC(shape)
+GC_FUNC(shape, cpShapeGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -313,7 +315,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
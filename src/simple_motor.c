@@ -29,7 +29,7 @@
 static int freesimple_motor(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "simple_motor")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -57,6 +57,7 @@ SETDOUBLE(SetRate, cpSimpleMotorSetRate, simple_motor)
 GETDOUBLE(GetRate, cpSimpleMotorGetRate, simple_motor)
 
 DESTROY_FUNC(simple_motor)
+GC_FUNC(simple_motor, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -68,7 +69,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -29,7 +29,7 @@
 static int freeslide_joint(lua_State *L, ud_t *ud)
     {
     constraint_t *constraint = (constraint_t*)ud->handle;
-    if(!candestroyconstraint(constraint, ud)) return 0;
+    if(!candestroyconstraint(L, constraint, ud)) return 0;
     if(!freeuserdata(L, ud, "slide_joint")) return 0;
     constraintdestroy(L, constraint);
     return 0;
@@ -69,6 +69,7 @@ GETDOUBLE(GetMin, cpSlideJointGetMin, slide_joint)
 GETDOUBLE(GetMax, cpSlideJointGetMax, slide_joint)
 
 DESTROY_FUNC(slide_joint)
+GC_FUNC(slide_joint, cpConstraintGetSpace)
 
 static const struct luaL_Reg Methods[] = 
     {
@@ -86,7 +87,7 @@ static const struct luaL_Reg Methods[] =
 
 static const struct luaL_Reg MetaMethods[] = 
     {
-        { "__gc",  Destroy },
+        { "__gc",  Gc },
         { NULL, NULL } /* sentinel */
     };
 
@@ -37,29 +37,192 @@
 typedef struct info_t {
     int ref[NREFS];
     cpSpaceDebugDrawOptions options;
+    lua_State *L; /* the state executing cpSpaceDebugDraw() */
+    double hash_dim; /* spatial hash parameters (hash_count=0 if not used) */
+    int hash_count;
+    records_t events; /* ring of recorded collision events (see collision_handler.c) */
+    records_t impacts; /* recorded post-solve impacts (ditto) */
+    constraint_t **broken; /* constraints broken in the current step (see constraint.c) */
+    int nbroken, brokensize;
+    stepper_t *stepper; /* fixed-step driver (see packed.c), or NULL */
+    stepstats_t *stats; /* step statistics (see tracing.c), or NULL if disabled */
+    async_t *async; /* async stepping (see packed.c), or NULL */
 } info_t;
 
+#define EVENT_CAPACITY  1024 /* default capacity of the events ring */
+#define IMPACT_CAPACITY 256  /* initial capacity of the impacts array */
+
+static void initinfo(info_t *info)
+    {
+    memset(info, 0, sizeof(info_t));
+    for(int i=0; i <NREFS; i++) info->ref[i] = LUA_NOREF;
+    initrecords(&info->events, COLLISION_EVENT_RECSIZE, EVENT_CAPACITY, 1);
+    initrecords(&info->impacts, IMPACT_RECSIZE, IMPACT_CAPACITY, 0);
+    }
+
 static void clearinfo(lua_State *L, info_t *info)
+/* releases the debug draw functions and options */
     {
     for(int i=0; i <NREFS; i++)
-        { if(info->ref[i]!=LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, info->ref[i]); }
-    memset(info, 0, sizeof(info_t));
+        { 
+        if(info->ref[i]!=LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, info->ref[i]);
+        info->ref[i] = LUA_NOREF;
+        }
+    memset(&info->options, 0, sizeof(info->options));
+    }
+
+/*------------------------------------------------------------------------------*
+ | Bulk detach                                                                  |
+ *------------------------------------------------------------------------------*/
+
+/* The objects in a space are collected in a single pass over it, and detached by
+ * resetting their links, instead of removing them one at a time with cpSpaceRemoveXxx()
+ * (which is not O(1), and which cannot be done while the space is locked, so it would
+ * need a post-step callback per object).
+ */
+
+typedef struct {
+    int count;
+    void **objects;
+} collect_t;
+
+static void countobject(void *object, void *data)
+    { ((collect_t*)data)->count++; (void)object; }
+
+static void collectobject(void *object, void *data)
+    { collect_t *c = (collect_t*)data; c->objects[c->count++] = object; }
+
+#define COLLECT(L, c, space, func, iterfunc) do {                       \
+    (c)->count = 0;                                                     \
+    func((space), (iterfunc)countobject, (c));                          \
+    (c)->objects = (void**)Malloc((L), ((c)->count+1)*sizeof(void*));   \
+    (c)->count = 0;                                                     \
+    func((space), (iterfunc)collectobject, (c));                        \
+} while(0)
+
+static void detachbody(body_t *body)
+    {
+    body->space = NULL;
+    body->shapeList = NULL;
+    body->constraintList = NULL;
+    body->arbiterList = NULL;
+    body->sleeping.root = NULL;
+    body->sleeping.next = NULL;
+    body->sleeping.idleTime = 0.0f;
+    }
+
+static void detachshape(shape_t *shape)
+    {
+    shape->space = NULL;
+    shape->next = NULL;
+    shape->prev = NULL;
+    shape->hashid = 0;
+    }
+
+static void detachconstraint(constraint_t *constraint)
+    {
+    constraint->space = NULL;
+    constraint->next_a = NULL;
+    constraint->next_b = NULL;
     }
 
-static void removebody(space_t *space, void *key, void *data)
-    { cpSpaceRemoveBody(space, (body_t*)key); (void)data; }
-static void postremovebody(body_t *body, void *data)
-    { cpSpaceAddPostStepCallback((space_t*)data, removebody, body, NULL); }
+static void PostStepFunc(space_t *space, void *key, void *data);
 
-static void removeshape(space_t *space, void *key, void *data)
-    { cpSpaceRemoveShape(space, (shape_t*)key); (void)data; }
-static void postremoveshape(shape_t *shape, void *data)
-    { cpSpaceAddPostStepCallback((space_t*)data, removeshape, shape, NULL);  }
+static void droppoststepcallbacks(lua_State *L, space_t *space)
+/* Releases the references to the Lua functions of the pending post-step callbacks
+ * (added by the script between steps), that cpSpaceDestroy()/cpSpaceFree() discard */
+    {
+    int i;
+    cpPostStepCallback *callback;
+    cpArray *callbacks = space->postStepCallbacks;
+    for(i = 0; i < callbacks->num; i++)
+        {
+        callback = (cpPostStepCallback*)callbacks->arr[i];
+        if(callback->func == PostStepFunc)
+            luaL_unref(L, LUA_REGISTRYINDEX, (int)(intptr_t)callback->key);
+        }
+    }
 
-static void removeconstraint(space_t *space, void *key, void *data)
-    { cpSpaceRemoveConstraint(space, (constraint_t*)key); (void)data; }
-static void postremoveconstraint(constraint_t *constraint, void *data)
-    { cpSpaceAddPostStepCallback((space_t*)data, removeconstraint, constraint, NULL);  }
+static void resetspace(space_t *space, info_t *info)
+/* Empties the space, preserving its parameters and its collision handlers */
+    {
+    cpSpace saved;
+    body_t *static_body = space->staticBody;
+    memcpy(&saved, space, sizeof(cpSpace));
+    space->collisionHandlers = NULL; /* so that cpSpaceDestroy() does not free them */
+    cpSpaceDestroy(space);
+    cpSpaceInit(space);
+    cpHashSetFree(space->collisionHandlers);
+    space->collisionHandlers = saved.collisionHandlers;
+    memcpy(&space->defaultHandler, &saved.defaultHandler, sizeof(cpCollisionHandler));
+    space->usesWildcards = saved.usesWildcards;
+    space->iterations = saved.iterations;
+    space->gravity = saved.gravity;
+    space->damping = saved.damping;
+    space->idleSpeedThreshold = saved.idleSpeedThreshold;
+    space->sleepTimeThreshold = saved.sleepTimeThreshold;
+    space->collisionSlop = saved.collisionSlop;
+    space->collisionBias = saved.collisionBias;
+    space->collisionPersistence = saved.collisionPersistence;
+    space->userData = saved.userData;
+    /* cpSpaceInit() re-initializes the embedded static body and designates it as the
+     * space's static body: restore what the script may have set on the previous one */
+    if(static_body == &space->_staticBody)
+        {
+        cpBodySetPosition(static_body, saved._staticBody.p);
+        cpBodySetAngle(static_body, saved._staticBody.a);
+        cpBodySetVelocityUpdateFunc(static_body, saved._staticBody.velocity_func);
+        cpBodySetPositionUpdateFunc(static_body, saved._staticBody.position_func);
+        cpBodySetUserData(static_body, saved._staticBody.userData); /* force fields, see body.c */
+        }
+    else
+        {
+        detachbody(static_body);
+        cpSpaceSetStaticBody(space, static_body);
+        }
+    if(info->hash_count > 0)
+        cpSpaceUseSpatialHash(space, info->hash_dim, info->hash_count);
+    }
+
+static void detachall(lua_State *L, space_t *space, info_t *info, int destroy)
+/* Detaches all the objects from the space. If destroy=1, also destroys the
+ * objects that are bound to Lua userdata and resets the space so that it can
+ * be reused, otherwise it leaves the space in an inconsistent state (it must
+ * be freed next).
+ */
+    {
+    int i;
+    ud_t *ud;
+    collect_t constraints, shapes, bodies;
+    COLLECT(L, &constraints, space, cpSpaceEachConstraint, cpSpaceConstraintIteratorFunc);
+    COLLECT(L, &shapes, space, cpSpaceEachShape, cpSpaceShapeIteratorFunc);
+    COLLECT(L, &bodies, space, cpSpaceEachBody, cpSpaceBodyIteratorFunc);
+    droppoststepcallbacks(L, space);
+    if(destroy) resetspace(space, info);
+    for(i = 0; i < constraints.count; i++)
+        {
+        detachconstraint((constraint_t*)constraints.objects[i]);
+        /* native joints (see collision_handler.c) have no owner other than the space */
+        if(!userdata(L, constraints.objects[i]))
+            { cpConstraintFree((constraint_t*)constraints.objects[i]); constraints.objects[i] = NULL; }
+        }
+    for(i = 0; i < shapes.count; i++)
+        detachshape((shape_t*)shapes.objects[i]);
+    for(i = 0; i < bodies.count; i++)
+        detachbody((body_t*)bodies.objects[i]);
+    if(destroy)
+        {
+        for(i = 0; i < constraints.count; i++)
+            { if(constraints.objects[i] && (ud = userdata(L, constraints.objects[i]))) ud->destructor(L, ud); }
+        for(i = 0; i < shapes.count; i++)
+            { if((ud = userdata(L, shapes.objects[i]))) ud->destructor(L, ud); }
+        for(i = 0; i < bodies.count; i++)
+            { if((ud = userdata(L, bodies.objects[i]))) ud->destructor(L, ud); }
+        }
+    Free(L, constraints.objects);
+    Free(L, shapes.objects);
+    Free(L, bodies.objects);
+    }
 
 static int freespace(lua_State *L, ud_t *ud)
     {
@@ -69,16 +232,20 @@ static int freespace(lua_State *L, ud_t *ud)
     int hasty = IsHasty(ud);
     info_t* info = (info_t*)ud->info;
     ud->info = NULL;
+    freeasync(L, info->async); /* waits for the async step in progress, if any */
     freechildren(L, COLLISION_HANDLER_MT, ud);
     if(!freeuserdata(L, ud, "space")) return 0;
+    static_body_ud = userdata(L, static_body); 
+    if(static_body_ud) freebody(L, static_body_ud);
+    /* detach all shapes, constraints and bodies */
+    detachall(L, space, info, 0);
     clearinfo(L, info);
+    freerecords(L, &info->events);
+    freerecords(L, &info->impacts);
+    if(info->broken) Free(L, info->broken);
+    freestepper(L, info->stepper);
+    freestepstats(L, space, info->stats);
     Free(L, info);
-    static_body_ud = userdata(static_body); 
-    if(static_body_ud) freebody(L, static_body_ud);
-    /* remove all shapes, constraints and bodies */
-    cpSpaceEachConstraint(space, postremoveconstraint, space);
-    cpSpaceEachShape(space, postremoveshape, space);
-    cpSpaceEachBody(space, postremovebody, space);
     hasty ? cpHastySpaceFree(space) : cpSpaceFree(space);
     return 0;
     }
@@ -87,12 +254,14 @@ static int newspace(lua_State *L, space_t *space, int hasty)
     {
     ud_t *ud;
     info_t *info = Malloc(L, sizeof(info_t));
+    initinfo(info);
     ud = newuserdata(L, space, SPACE_MT, "space");
     ud->parent_ud = NULL;
     ud->destructor = freespace;
     ud->static_body = NULL;
     ud->info = info;
     if(hasty) MarkHasty(ud);
+    cpSpaceSetUserData(space, getctx(L));
     return 1;
     }
 
@@ -137,7 +306,7 @@ static int GetGravity(lua_State *L)
     {
     space_t *space = checkspace(L, 1, NULL);
     vec_t gravity = cpSpaceGetGravity(space);
-    pushvec(L, &gravity);
+    pushvecout(L, 2, &gravity);
     return 1;
     }
 
@@ -156,22 +325,28 @@ F(SetCollisionSlop, cpSpaceSetCollisionSlop)
 F(SetCollisionBias, cpSpaceSetCollisionBias)
 #undef F
 
+void stepspace(ud_t *ud, double dt)
+    {
+    space_t *space = (space_t*)ud->handle;
+    info_t *info = (info_t*)ud->info;
+    ctx_t *ctx = spacectx(space);
+    double t0 = tracebegin(ctx);
+    if(info->stats)
+        timedstep(info->stats, space, IsHasty(ud), dt);
+    else
+        IsHasty(ud) ? cpHastySpaceStep(space, dt) : cpSpaceStep(space, dt);
+    traceend(ctx, "step", "step", t0);
+    }
+
 static int Step(lua_State *L)
     {
-    int i;
+    int i, n;
+    double dt;
     ud_t *ud;
-    space_t *space = checkspace(L, 1, &ud);
-    double dt = luaL_checknumber(L, 2);
-    int n = luaL_optinteger(L, 3, 1);
-    if(n==1)
-        IsHasty(ud) ? cpHastySpaceStep(space, dt) : cpSpaceStep(space, dt);
-    else
-        {
-        if(IsHasty(ud))
-            for(i=0; i<n; i++) cpHastySpaceStep(space, dt);
-        else
-            for(i=0; i<n; i++) cpSpaceStep(space, dt);
-        }
+    (void)checkspace(L, 1, &ud);
+    dt = luaL_checknumber(L, 2);
+    n = luaL_optinteger(L, 3, 1);
+    for(i=0; i<n; i++) stepspace(ud, dt);
     return 0;
     }
 
@@ -223,7 +398,7 @@ static int GetStaticBody(lua_State *L)
     ud_t *space_ud;
     space_t *space = checkspace(L, 1, &space_ud);
     body_t* body = cpSpaceGetStaticBody(space);
-    ud_t *ud = userdata(body);
+    ud_t *ud = userdata(L, body);
     if(ud)
         pushbody(L, body);
     else /* create userdata for borrowed body */
@@ -300,21 +475,76 @@ static int ReindexShapesForBody(lua_State *L)
 
 static int UseSpatialHash(lua_State *L)
     {
-    space_t *space = checkspace(L, 1, NULL);
+    ud_t *ud;
+    space_t *space = checkspace(L, 1, &ud);
+    info_t *info = (info_t*)ud->info;
     double dim = luaL_checknumber(L, 2);
     int count = luaL_checkinteger(L, 3);
     cpSpaceUseSpatialHash(space, dim, count);
+    info->hash_dim = dim;
+    info->hash_count = count;
     return 0;
     }
 
+int usesspatialhash(ud_t *ud)
+/* Returns 1 if the space uses the spatial hash, 0 if it uses the default bb tree */
+    { return ((info_t*)ud->info)->hash_count != 0; }
+
+records_t *spaceevents(ud_t *ud)
+    { return &((info_t*)ud->info)->events; }
+
+records_t *spaceimpacts(ud_t *ud)
+    { return &((info_t*)ud->info)->impacts; }
+
+stepper_t **spacestepper(ud_t *ud)
+    { return &((info_t*)ud->info)->stepper; }
+
+stepstats_t **spacestepstats(ud_t *ud)
+    { return &((info_t*)ud->info)->stats; }
+
+async_t **spaceasync(ud_t *ud)
+    { return &((info_t*)ud->info)->async; }
+
+static int Clear(lua_State *L)
+    {
+    ud_t *ud;
+    space_t *space = checkspace(L, 1, &ud);
+    if(cpSpaceIsLocked(space)) return failure(L, ERR_OPERATION);
+    releasestickyjoints(L, ud);
+    detachall(L, space, (info_t*)ud->info, 1);
+    /* the hash ids restart from 0, so the recorded events and impacts would refer to the new shapes */
+    freerecords(L, &((info_t*)ud->info)->events);
+    freerecords(L, &((info_t*)ud->info)->impacts);
+    return 0;
+    }
+
+
+/* Data passed to the iterator and query callbacks: */
+typedef struct {
+    lua_State *L;   /* the state that called the iterator/query function */
+    space_t *space;
+    int func;       /* stack index of the Lua callback */
+    /* collecting queries (see checkresults()) */
+    int mode;       /* QUERY_XXX */
+    int nfields;    /* no. of fields per hit, including the shape */
+    int count;      /* no. of hits so far */
+    double *dst;    /* QUERY_BUFFER: destination of the records */
+    int maxcount;   /* QUERY_BUFFER: max no. of records that fit in dst */
+} query_t;
+
+#define QUERY_FUNC      0 /* call a Lua function for each hit */
+#define QUERY_TABLE     1 /* collect the hits in a table, one array per field */
+#define QUERY_BUFFER    2 /* collect the hits in a buffer, as records of doubles */
 
 #define F(Func, What, what)                                                 \
-static void IteratorFunc##What(what##_t *what, void *data /*=space*/)       \
+static void IteratorFunc##What(what##_t *what, void *data)                  \
     {                                                                       \
-    lua_State *L = moonchipmunk_L;                                          \
+    query_t *q = (query_t*)data;                                            \
+    lua_State *L = q->L;                                                    \
     int top = lua_gettop(L);                                                \
-    lua_pushvalue(L, 2);    /* the function */                              \
-    pushspace(L, (space_t*)data);                                           \
+    if(!userdata(L, what)) return; /* not visible to Lua (native joint) */  \
+    lua_pushvalue(L, q->func);                                              \
+    pushspace(L, q->space);                                                 \
     push##what(L, what);                                                    \
     if(lua_pcall(L, 2, 0, 0) != LUA_OK)                                     \
         { lua_error(L); return; }                                           \
@@ -322,9 +552,11 @@ static void IteratorFunc##What(what##_t *what, void *data /*=space*/)       \
     }                                                                       \
 static int Func(lua_State *L)                                               \
     {                                                                       \
+    query_t q;                                                              \
     space_t *space = checkspace(L, 1, NULL);                                \
     if(!lua_isfunction(L, 2)) return argerror(L, 2, ERR_FUNCTION);          \
-    cpSpaceEach##What(space, IteratorFunc##What, /*data=*/space);           \
+    q.L = L; q.space = space; q.func = 2;                                   \
+    cpSpaceEach##What(space, IteratorFunc##What, &q);                       \
     return 0;                                                               \
     }
 F(EachBody, Body, body)
@@ -364,12 +596,12 @@ static int AddWildcardHandler(lua_State *L)
 static void PostStepFunc(space_t *space, void *key, void *data)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
+    lua_State *L = spacectx(space)->L;
     intptr_t ref = (intptr_t)key;
     (void)data;
     lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
     pushspace(L, space);
-    rc = lua_pcall(L, 1, 0, 0);
+    rc = timedpcall(L, space, CALLBACK_POST_STEP, 1, 0);
     luaL_unref(L, LUA_REGISTRYINDEX, ref);
     if(rc!=LUA_OK) lua_error(L);
     }
@@ -387,18 +619,105 @@ static int AddPostStepCallback(lua_State *L)
     return 0;
     }
 
+// Broken constraints ---------------------------------------------------------
+/* Constraints whose break force is exceeded are queued by breakconstraint() during the
+ * step, and removed all together by a single post-step callback, which then passes them
+ * to the break func (ud->ref1) in one call. */
+
+static void BreakFunc(space_t *space, void *key, void *data)
+    {
+    int i, n, rc;
+    lua_State *L = spacectx(space)->L;
+    ud_t *ud = (ud_t*)data;
+    info_t *info = (info_t*)ud->info;
+    constraint_t *constraint;
+    (void)key;
+    n = info->nbroken;
+    info->nbroken = 0;
+    if(ud->ref1 != LUA_NOREF)
+        {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
+        pushspace(L, space);
+        lua_newtable(L);
+        }
+    for(i = 0; i < n; i++)
+        {
+        constraint = info->broken[i];
+        if(!userdata(L, constraint)) continue; /* destroyed in the meanwhile */
+        if(cpConstraintGetSpace(constraint) != space) continue; /* already removed */
+        cpSpaceRemoveConstraint(space, constraint);
+        if(ud->ref1 != LUA_NOREF)
+            {
+            pushconstraint(L, constraint);
+            lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+            }
+        }
+    if(ud->ref1 == LUA_NOREF) return;
+    if(lua_rawlen(L, -1) == 0) { lua_pop(L, 3); return; }
+    rc = timedpcall(L, space, CALLBACK_POST_STEP, 2, 0);
+    if(rc!=LUA_OK) lua_error(L);
+    }
+
+void breakconstraint(lua_State *L, space_t *space, constraint_t *constraint)
+    {
+    constraint_t **broken;
+    ud_t *ud = userdata(L, space);
+    info_t *info;
+    if(!ud) { unexpected(L); return; }
+    info = (info_t*)ud->info;
+    if(info->nbroken == info->brokensize)
+        {
+        info->brokensize = info->brokensize ? 2*info->brokensize : 16;
+        broken = (constraint_t**)Malloc(L, info->brokensize*sizeof(constraint_t*));
+        if(info->broken)
+            {
+            memcpy(broken, info->broken, info->nbroken*sizeof(constraint_t*));
+            Free(L, info->broken);
+            }
+        info->broken = broken;
+        }
+    info->broken[info->nbroken++] = constraint;
+    /* the key makes it one callback per step, no matter how many constraints break */
+    cpSpaceAddPostStepCallback(space, BreakFunc, &info->broken, ud);
+    }
+
+static int SetBreakFunc(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkspace(L, 1, &ud);
+    if(lua_isnoneornil(L, 2))
+        { Unreference(L, ud->ref1); return 0; }
+    if(!lua_isfunction(L, 2))
+        return argerror(L, 2, ERR_FUNCTION);
+    Reference(L, 2, ud->ref1);
+    return 0;
+    }
+
+static int GetBreakFunc(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkspace(L, 1, &ud);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
+    return 1;
+    }
+
 static int SegmentQueryFirst(lua_State *L)
     {
     vec_t start, end;
     double radius;
     cpShapeFilter filter;
     cpSegmentQueryInfo out;
+    double t0;
+    shape_t *shape;
     space_t *space = checkspace(L, 1, NULL);
     checkvec(L, 2, &start);
     checkvec(L, 3, &end);
     radius = luaL_checknumber(L, 4);
     checkshapefilter(L, 5, &filter);
-    if(cpSpaceSegmentQueryFirst(space, start, end, radius, filter, &out)!=NULL)
+    t0 = tracebegin(spacectx(space));
+    shape = cpSpaceSegmentQueryFirst(space, start, end, radius, filter, &out);
+    traceend(spacectx(space), "query", "segment_query_first", t0);
+    if(shape)
         pushsegmentqueryinfo(L, &out);
     else
         lua_pushnil(L);
@@ -411,25 +730,118 @@ static int PointQueryNearest(lua_State *L)
     double maxdist;
     cpShapeFilter filter;
     cpPointQueryInfo out;
+    double t0;
+    shape_t *shape;
     space_t *space = checkspace(L, 1, NULL);
     checkvec(L, 2, &point);
     maxdist = luaL_checknumber(L, 3);
     checkshapefilter(L, 4, &filter);
-    if(cpSpacePointQueryNearest(space, point, maxdist, filter, &out)!=NULL)
+    t0 = tracebegin(spacectx(space));
+    shape = cpSpacePointQueryNearest(space, point, maxdist, filter, &out);
+    traceend(spacectx(space), "query", "point_query_nearest", t0);
+    if(shape)
         pushpointqueryinfo(L, &out);
     else
         lua_pushnil(L);
     return 1;
     }
 
+/* Collecting queries --------------------------------------------------------
+ * If, instead of a function, a table is passed to a query function, the hits
+ * are collected in it, in one array per field (t.shape, t.px, t.py, ...), and the
+ * query returns the number of hits. The arrays are created if not present, and
+ * reused otherwise (entries beyond the number of hits are left untouched).
+ * If a buffer is passed instead, the hits are written in it as records of
+ * doubles, with the shape's hash id in place of the shape.
+ */
+
+static void checkresults(lua_State *L, int arg, query_t *q, const char *fields[])
+/* Checks the function/table/buffer argument at arg and inits q accordingly.
+ * In the QUERY_TABLE mode the arrays are pushed on the stack, starting from q->func. */
+    {
+    int i;
+    size_t size;
+    q->L = L;
+    q->count = 0;
+    q->func = arg;
+    for(q->nfields = 0; fields[q->nfields] != NULL; q->nfields++);
+    if(lua_isfunction(L, arg)) { q->mode = QUERY_FUNC; return; }
+    if((q->dst = (double*)testbuffer(L, arg, &size)) != NULL)
+        {
+        q->mode = QUERY_BUFFER;
+        q->maxcount = size / (q->nfields*sizeof(double));
+        return;
+        }
+    if(!lua_istable(L, arg)) { argerror(L, arg, ERR_FUNCTION); return; }
+    q->mode = QUERY_TABLE;
+    lua_settop(L, arg);
+    q->func = arg + 1;
+    for(i = 0; i < q->nfields; i++)
+        {
+        if(lua_getfield(L, arg, fields[i]) != LUA_TTABLE)
+            {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, arg, fields[i]);
+            }
+        }
+    }
+
+static void collecthit(query_t *q, shape_t *shape, const double *vals)
+/* Collects a hit, whose fields other than the shape are in vals[] */
+    {
+    int i;
+    double *rec;
+    lua_State *L = q->L;
+    q->count++;
+    if(q->mode == QUERY_TABLE)
+        {
+        pushshape(L, shape);
+        lua_rawseti(L, q->func, q->count);
+        for(i = 1; i < q->nfields; i++)
+            {
+            lua_pushnumber(L, vals[i-1]);
+            lua_rawseti(L, q->func + i, q->count);
+            }
+        return;
+        }
+    if(q->count > q->maxcount) return; /* buffer full */
+    rec = q->dst + (size_t)(q->count - 1)*q->nfields;
+    rec[0] = (double)shape->hashid;
+    for(i = 1; i < q->nfields; i++) rec[i] = vals[i-1];
+    }
+
+static int pushresults(lua_State *L, query_t *q)
+    {
+    if(q->mode == QUERY_BUFFER)
+        {
+        lua_pushinteger(L, q->count < q->maxcount ? q->count : q->maxcount);
+        lua_pushinteger(L, q->count);
+        return 2;
+        }
+    lua_pushinteger(L, q->count);
+    return 1;
+    }
+
+static const char *PointQueryFields[] = { "shape", "px", "py", "distance", "gx", "gy", NULL };
+static const char *SegmentQueryFields[] = { "shape", "px", "py", "nx", "ny", "alpha", NULL };
+static const char *BBQueryFields[] = { "shape", NULL };
+static const char *ShapeQueryFields[] = { "shape", "nx", "ny", NULL };
+
 static void PointQueryFunc(shape_t *shape, vec_t point, double distance, vec_t gradient, void *data)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
-    space_t *space = (space_t*)data;
-    ud_t *ud = userdata(space);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
-    pushspace(L, space);
+    query_t *q = (query_t*)data;
+    lua_State *L = q->L;
+    if(q->mode != QUERY_FUNC)
+        {
+        double vals[] = { point.x, point.y, distance, gradient.x, gradient.y };
+        collecthit(q, shape, vals);
+        return;
+        }
+    lua_pushvalue(L, q->func);
+    pushspace(L, q->space);
     pushshape(L, shape);
     pushvec(L, &point);
     lua_pushnumber(L, distance);
@@ -440,30 +852,36 @@ static void PointQueryFunc(shape_t *shape, vec_t point, double distance, vec_t g
 
 static int PointQuery(lua_State *L)
     {
-    ud_t *ud;
+    query_t q;
+    double t0;
     vec_t point;
     double maxdist;
     cpShapeFilter filter;
-    space_t *space = checkspace(L, 1, &ud);
+    space_t *space = checkspace(L, 1, NULL);
     checkvec(L, 2, &point);
     maxdist = luaL_checknumber(L, 3);
     checkshapefilter(L, 4, &filter);
-    if(!lua_isfunction(L, 5)) return argerror(L, 5, ERR_FUNCTION);
-    lua_pushvalue(L, 5);
-    ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
-    cpSpacePointQuery(space, point, maxdist, filter, PointQueryFunc, space);
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->ref1);
-    return 0;
+    q.space = space;
+    checkresults(L, 5, &q, PointQueryFields);
+    t0 = tracebegin(spacectx(space));
+    cpSpacePointQuery(space, point, maxdist, filter, PointQueryFunc, &q);
+    traceend(spacectx(space), "query", "point_query", t0);
+    return q.mode == QUERY_FUNC ? 0 : pushresults(L, &q);
     }
 
 static void SegmentQueryFunc(shape_t *shape, vec_t point, vec_t normal, double alpha, void *data)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
-    space_t *space = (space_t*)data;
-    ud_t *ud = userdata(space);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
-    pushspace(L, space);
+    query_t *q = (query_t*)data;
+    lua_State *L = q->L;
+    if(q->mode != QUERY_FUNC)
+        {
+        double vals[] = { point.x, point.y, normal.x, normal.y, alpha };
+        collecthit(q, shape, vals);
+        return;
+        }
+    lua_pushvalue(L, q->func);
+    pushspace(L, q->space);
     pushshape(L, shape);
     pushvec(L, &point);
     pushvec(L, &normal);
@@ -474,60 +892,67 @@ static void SegmentQueryFunc(shape_t *shape, vec_t point, vec_t normal, double a
 
 static int SegmentQuery(lua_State *L)
     {
-    ud_t *ud;
+    query_t q;
+    double t0;
     vec_t start, end;
     double radius;
     cpShapeFilter filter;
-    space_t *space = checkspace(L, 1, &ud);
+    space_t *space = checkspace(L, 1, NULL);
     checkvec(L, 2, &start);
     checkvec(L, 3, &end);
     radius = luaL_checknumber(L, 4);
     checkshapefilter(L, 5, &filter);
-    if(!lua_isfunction(L, 6)) return argerror(L, 6, ERR_FUNCTION);
-    lua_pushvalue(L, 6);
-    ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
-    cpSpaceSegmentQuery(space, start, end, radius, filter, SegmentQueryFunc, space);
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->ref1);
-    return 0;
+    q.space = space;
+    checkresults(L, 6, &q, SegmentQueryFields);
+    t0 = tracebegin(spacectx(space));
+    cpSpaceSegmentQuery(space, start, end, radius, filter, SegmentQueryFunc, &q);
+    traceend(spacectx(space), "query", "segment_query", t0);
+    return q.mode == QUERY_FUNC ? 0 : pushresults(L, &q);
     }
 
 
 static void BBQueryFunc(shape_t *shape, void *data)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
-    space_t *space = (space_t*)data;
-    ud_t *ud = userdata(space);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
-    pushspace(L, space);
+    query_t *q = (query_t*)data;
+    lua_State *L = q->L;
+    if(q->mode != QUERY_FUNC) { collecthit(q, shape, NULL); return; }
+    lua_pushvalue(L, q->func);
+    pushspace(L, q->space);
     pushshape(L, shape);
     rc = lua_pcall(L, 2, 0, 0);
     if(rc!=LUA_OK) lua_error(L);
     }
 static int BBQuery(lua_State *L)
     {
-    ud_t *ud;
+    query_t q;
+    double t0;
     bb_t bb;
     cpShapeFilter filter;
-    space_t *space = checkspace(L, 1, &ud);
+    space_t *space = checkspace(L, 1, NULL);
     checkbb(L, 2, &bb);
     checkshapefilter(L, 3, &filter);
-    if(!lua_isfunction(L, 4)) return argerror(L, 4, ERR_FUNCTION);
-    lua_pushvalue(L, 4);
-    ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
-    cpSpaceBBQuery(space, bb, filter, BBQueryFunc, space);
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->ref1);
-    return 0;
+    q.space = space;
+    checkresults(L, 4, &q, BBQueryFields);
+    t0 = tracebegin(spacectx(space));
+    cpSpaceBBQuery(space, bb, filter, BBQueryFunc, &q);
+    traceend(spacectx(space), "query", "bb_query", t0);
+    return q.mode == QUERY_FUNC ? 0 : pushresults(L, &q);
     }
 
 static void ShapeQueryFunc(shape_t *shape, cpContactPointSet *points, void *data)
     {
     int rc;
-    lua_State *L = moonchipmunk_L;
-    space_t *space = (space_t*)data;
-    ud_t *ud = userdata(space);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
-    pushspace(L, space);
+    query_t *q = (query_t*)data;
+    lua_State *L = q->L;
+    if(q->mode != QUERY_FUNC)
+        {
+        double vals[] = { points->normal.x, points->normal.y };
+        collecthit(q, shape, vals);
+        return;
+        }
+    lua_pushvalue(L, q->func);
+    pushspace(L, q->space);
     pushshape(L, shape);
     pushcontactpointset(L, points); // normal, {points}
     rc = lua_pcall(L, 4, 0, 0);
@@ -535,18 +960,22 @@ static void ShapeQueryFunc(shape_t *shape, cpContactPointSet *points, void *data
     }
 static int ShapeQuery(lua_State *L)
     {
-    ud_t *ud;
-    bb_t bb;
-    cpShapeFilter filter;
-    space_t *space = checkspace(L, 1, &ud);
+    query_t q;
+    double t0;
+    cpBool res;
+    space_t *space = checkspace(L, 1, NULL);
     shape_t *shape = checkshape(L, 2, NULL);
-    if(!lua_isfunction(L, 3)) return argerror(L, 3, ERR_FUNCTION);
-    lua_pushvalue(L, 3);
-    ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
-    cpSpaceBBQuery(space, bb, filter, BBQueryFunc, space);
-    lua_pushboolean(L, cpSpaceShapeQuery(space, shape, ShapeQueryFunc, space));
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->ref1);
-    return 1;
+    q.space = space;
+    checkresults(L, 3, &q, ShapeQueryFields);
+    t0 = tracebegin(spacectx(space));
+    res = cpSpaceShapeQuery(space, shape, ShapeQueryFunc, &q);
+    traceend(spacectx(space), "query", "shape_query", t0);
+    if(q.mode == QUERY_FUNC)
+        {
+        lua_pushboolean(L, res);
+        return 1;
+        }
+    return pushresults(L, &q);
     }
 
 static int SetThreads(lua_State *L)
@@ -574,8 +1003,8 @@ static int GetThreads(lua_State *L)
     }
 
 
-#define L moonchipmunk_L
 #define info ((info_t*)(data))
+#define L (info->L)
 static void DrawCircle(vec_t pos, double angle, double radius, color_t outlineColor, color_t fillColor, void* data)
     {
     int rc;
@@ -698,6 +1127,7 @@ static int DebugDraw(lua_State *L)
     info_t *info = (info_t*)ud->info;
     if(info->ref[0]==LUA_NOREF)
         return luaL_error(L, "debug draw options are not set");
+    info->L = L;
     cpSpaceDebugDraw(space, &(info->options));
     return 0;
     }
@@ -737,6 +1167,7 @@ static const struct luaL_Reg Methods[] =
         { "remove_shape", RemoveShape },
         { "remove_body", RemoveBody },
         { "remove_constraint", RemoveConstraint },
+        { "clear", Clear },
         { "contains_shape", ContainsShape },
         { "contains_body", ContainsBody },
         { "contains_constraint", ContainsConstraint },
@@ -751,6 +1182,8 @@ static const struct luaL_Reg Methods[] =
         { "add_collision_handler", AddCollisionHandler },
         { "add_wildcard_handler", AddWildcardHandler },
         { "add_post_step_callback", AddPostStepCallback },
+        { "set_break_func", SetBreakFunc },
+        { "get_break_func", GetBreakFunc },
         { "segment_query_first", SegmentQueryFirst },
         { "point_query_nearest", PointQueryNearest },
         { "point_query", PointQuery },
@@ -24,12 +24,141 @@
  */
 
 #include "internal.h"
-    
-int trace_objects = 0;
+
+/*------------------------------------------------------------------------------*
+ | Trace recorder                                                               |
+ *------------------------------------------------------------------------------*/
+
+/* The recorder logs timestamped events in a ring (the oldest events are overwritten
+ * when it is full), and dumps them on demand in the Chrome trace-event JSON format
+ * (viewable e.g. with chrome://tracing or https://ui.perfetto.dev).
+ * Spans (steps, Lua callbacks, queries) are logged as complete events ('X') when
+ * they end, so that there are no unmatched begin/end pairs when the ring wraps.
+ * Object creation and destruction (see trace_objects()) are logged as instant events.
+ */
+
+typedef struct {
+    double ts, dur; /* seconds since the start of the trace (dur < 0: instant event) */
+    const char *cat, *name; /* static strings */
+    long long a, b; /* args (TRACE_NOARG if none) */
+} event_t;
+
+struct moonchipmunk_tracer_s {
+    double t0; /* start time */
+    size_t capacity, first, count, lost;
+    event_t events[1];
+};
+
+#define DEFAULT_TRACE_CAPACITY 65536
+
+static event_t *newevent(tracer_t *tracer)
+    {
+    if(tracer->count < tracer->capacity)
+        return &tracer->events[(tracer->first + tracer->count++) % tracer->capacity];
+    tracer->lost++;
+    tracer->first = (tracer->first + 1) % tracer->capacity;
+    return &tracer->events[(tracer->first + tracer->count - 1) % tracer->capacity];
+    }
+
+void tracecomplete(tracer_t *tracer, const char *cat, const char *name, double t0, long long a, long long b)
+    {
+    double t = now();
+    event_t *ev = newevent(tracer);
+    ev->ts = t0 - tracer->t0;
+    ev->dur = t - t0;
+    ev->cat = cat;
+    ev->name = name;
+    ev->a = a;
+    ev->b = b;
+    }
+
+void traceinstant(tracer_t *tracer, const char *cat, const char *name, const void *handle)
+    {
+    event_t *ev = newevent(tracer);
+    ev->ts = now() - tracer->t0;
+    ev->dur = -1;
+    ev->cat = cat;
+    ev->name = name;
+    ev->a = (long long)(uintptr_t)handle;
+    ev->b = TRACE_NOARG;
+    }
+
+void freetracer(lua_State *L, tracer_t *tracer)
+    {
+    if(tracer) Free(L, tracer);
+    }
+
+static int TraceStart(lua_State *L)
+    {
+    ctx_t *ctx = getctx(L);
+    lua_Integer capacity = luaL_optinteger(L, 1, DEFAULT_TRACE_CAPACITY);
+    if(capacity < 1) return argerror(L, 1, ERR_VALUE);
+    freetracer(L, ctx->tracer);
+    ctx->tracer = NULL;
+    ctx->tracer = (tracer_t*)Malloc(L, sizeof(tracer_t) + (capacity-1)*sizeof(event_t));
+    ctx->tracer->capacity = (size_t)capacity;
+    ctx->tracer->t0 = now();
+    return 0;
+    }
+
+static int TraceStop(lua_State *L)
+    {
+    ctx_t *ctx = getctx(L);
+    freetracer(L, ctx->tracer);
+    ctx->tracer = NULL;
+    return 0;
+    }
+
+static int TraceDump(lua_State *L)
+/* [json, ] count, lost = trace_dump([filename]) */
+    {
+    size_t i;
+    char s[256];
+    const event_t *ev;
+    luaL_Buffer b;
+    FILE *f = NULL;
+    tracer_t *tracer = getctx(L)->tracer;
+    const char *filename = luaL_optstring(L, 1, NULL);
+    if(!tracer) return failure(L, ERR_OPERATION);
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for(i = 0; i < tracer->count; i++)
+        {
+        ev = &tracer->events[(tracer->first + i) % tracer->capacity];
+        snprintf(s, sizeof(s), "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":1,\"tid\":1,\"ts\":%.3f",
+                i == 0 ? "" : ",", ev->name, ev->cat, ev->ts*1e6);
+        luaL_addstring(&b, s);
+        if(ev->dur < 0)
+            snprintf(s, sizeof(s), ",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"handle\":\"0x%llx\"}}",
+                (unsigned long long)ev->a);
+        else if(ev->a != TRACE_NOARG)
+            snprintf(s, sizeof(s), ",\"ph\":\"X\",\"dur\":%.3f,\"args\":{\"type_a\":%lld,\"type_b\":%lld}}",
+                ev->dur*1e6, ev->a, ev->b);
+        else
+            snprintf(s, sizeof(s), ",\"ph\":\"X\",\"dur\":%.3f}", ev->dur*1e6);
+        luaL_addstring(&b, s);
+        }
+    luaL_addstring(&b, "\n]}\n");
+    luaL_pushresult(&b);
+    if(filename)
+        {
+        size_t len;
+        const char *json = lua_tolstring(L, -1, &len);
+        if((f = fopen(filename, "w")) == NULL)
+            return luaL_error(L, "cannot open %s", filename);
+        if(fwrite(json, 1, len, f) != len)
+            { fclose(f); return luaL_error(L, "cannot write %s", filename); }
+        fclose(f);
+        lua_pop(L, 1);
+        }
+    lua_pushinteger(L, tracer->count);
+    lua_pushinteger(L, tracer->lost);
+    return filename ? 2 : 3;
+    }
 
 static int TraceObjects(lua_State *L)
     {
-    trace_objects = checkboolean(L, 1);
+    getctx(L)->trace_objects = checkboolean(L, 1);
     return 0;
     }
 
@@ -46,18 +175,220 @@ static int Since(lua_State *L)
     return 1;
     }
 
+static int RegistryStats(lua_State *L)
+    {
+    size_t live, capacity, highwater;
+    udata_stats(L, &live, &capacity, &highwater);
+    lua_pushinteger(L, live);
+    lua_pushinteger(L, capacity);
+    lua_pushinteger(L, highwater);
+    return 3;
+    }
+
+static int RegistryReserve(lua_State *L)
+    {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    if(n < 0) return argerror(L, 1, ERR_VALUE);
+    udata_reserve(L, (size_t)n);
+    return 0;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Step statistics                                                              |
+ *------------------------------------------------------------------------------*/
+
+/* When enabled for a space, each step is timed and a sample of its statistics is added
+ * to a ring of the last 'window' samples. During the step, ctx->stepstats points to the
+ * stats of the stepping space, so that timedpcall() can charge the time spent in Lua
+ * callbacks to them. Chipmunk has no hooks inside cpSpaceStep(), so the step time cannot
+ * be split further (e.g. broadphase/narrowphase/solver).
+ */
+
+typedef struct {
+    double step_time; /* wall time of the step (seconds) */
+    double cb_time[NCALLBACKKINDS]; /* time spent in Lua callbacks, by kind */
+    double cb_calls[NCALLBACKKINDS]; /* no. of Lua callbacks invoked, by kind */
+    double arbiters, contacts, active_bodies; /* counts at the end of the step */
+} sample_t;
+
+#define NFIELDS (sizeof(sample_t)/sizeof(double))
+
+static const char *SampleFields[] = { /* in the same order as in sample_t */
+    "step_time",
+    "handler_time", "body_time", "constraint_time", "post_step_time",
+    "handler_calls", "body_calls", "constraint_calls", "post_step_calls",
+    "arbiters", "contacts", "active_bodies",
+    NULL
+};
+
+struct moonchipmunk_stepstats_s {
+    sample_t cur; /* the step being measured */
+    int window; /* max no. of samples in the ring */
+    int first, count;
+    double steps; /* total no. of steps measured */
+    sample_t samples[1]; /* ring of the last 'window' samples */
+};
+
+#define DEFAULT_WINDOW 60
+
+static const char *CallbackNames[NCALLBACKKINDS] =
+    { "collision handler", "body update func", "constraint func", "post step callback" };
+
+int tracedpcall(lua_State *L, space_t *space, int kind, const char *name, long long a, long long b, int nargs, int nresults)
+/* Executes a Lua callback with lua_pcall(), charging its time to the step statistics,
+ * and logging it in the trace, if enabled. */
+    {
+    int rc;
+    double t0;
+    ctx_t *ctx = spacectx(space);
+    stepstats_t *stats = ctx->stepstats;
+    if(!stats && !ctx->tracer) return lua_pcall(L, nargs, nresults, 0);
+    t0 = now();
+    rc = lua_pcall(L, nargs, nresults, 0);
+    if(stats)
+        {
+        stats->cur.cb_time[kind] += since(t0);
+        stats->cur.cb_calls[kind]++;
+        }
+    if(ctx->tracer)
+        tracecomplete(ctx->tracer, "callback", name ? name : CallbackNames[kind], t0, a, b);
+    return rc;
+    }
+
+int timedpcall(lua_State *L, space_t *space, int kind, int nargs, int nresults)
+    { return tracedpcall(L, space, kind, NULL, TRACE_NOARG, TRACE_NOARG, nargs, nresults); }
+
+void timedstep(stepstats_t *stats, space_t *space, int hasty, double dt)
+    {
+    int i;
+    double t0;
+    ctx_t *ctx = spacectx(space);
+    stepstats_t *saved = ctx->stepstats;
+    sample_t *sample;
+    memset(&stats->cur, 0, sizeof(sample_t));
+    ctx->stepstats = stats;
+    t0 = now();
+    hasty ? cpHastySpaceStep(space, dt) : cpSpaceStep(space, dt);
+    stats->cur.step_time = since(t0);
+    ctx->stepstats = saved;
+    stats->cur.arbiters = space->arbiters->num;
+    for(i = 0; i < space->arbiters->num; i++)
+        stats->cur.contacts += cpArbiterGetCount((cpArbiter*)space->arbiters->arr[i]);
+    stats->cur.active_bodies = space->dynamicBodies->num;
+    /* add the sample to the ring */
+    if(stats->count < stats->window)
+        sample = &stats->samples[(stats->first + stats->count++) % stats->window];
+    else
+        {
+        sample = &stats->samples[stats->first];
+        stats->first = (stats->first + 1) % stats->window;
+        }
+    *sample = stats->cur;
+    stats->steps++;
+    }
+
+void freestepstats(lua_State *L, space_t *space, stepstats_t *stats)
+    {
+    ctx_t *ctx = spacectx(space);
+    if(!stats) return;
+    if(ctx->stepstats == stats) ctx->stepstats = NULL;
+    Free(L, stats);
+    }
+
+static int SetStepStats(lua_State *L)
+    {
+    ud_t *ud;
+    stepstats_t **stats;
+    int enable, window;
+    space_t *space = checkspace(L, 1, &ud);
+    enable = checkboolean(L, 2);
+    window = luaL_optinteger(L, 3, DEFAULT_WINDOW);
+    if(window < 1) return argerror(L, 3, ERR_VALUE);
+    if(cpSpaceIsLocked(space)) return failure(L, ERR_OPERATION);
+    stats = spacestepstats(ud);
+    freestepstats(L, space, *stats);
+    *stats = NULL;
+    if(!enable) return 0;
+    *stats = (stepstats_t*)Malloc(L, sizeof(stepstats_t) + (window-1)*sizeof(sample_t));
+    (*stats)->window = window;
+    return 0;
+    }
+
+static void pushsample(lua_State *L, const double *v)
+    {
+    size_t i;
+    lua_newtable(L);
+    for(i = 0; i < NFIELDS; i++)
+        {
+        lua_pushnumber(L, v[i]);
+        lua_setfield(L, -2, SampleFields[i]);
+        }
+    }
+
+static int GetStepStats(lua_State *L)
+    {
+    ud_t *ud;
+    int i;
+    size_t j;
+    stepstats_t *stats;
+    const double *v;
+    double min[NFIELDS], max[NFIELDS], avg[NFIELDS];
+    (void)checkspace(L, 1, &ud);
+    stats = *spacestepstats(ud);
+    if(!stats || stats->count == 0) return 0;
+    for(i = 0; i < stats->count; i++)
+        {
+        v = (const double*)&stats->samples[(stats->first + i) % stats->window];
+        for(j = 0; j < NFIELDS; j++)
+            {
+            if(i == 0) { min[j] = max[j] = avg[j] = v[j]; continue; }
+            if(v[j] < min[j]) min[j] = v[j];
+            if(v[j] > max[j]) max[j] = v[j];
+            avg[j] += v[j];
+            }
+        }
+    for(j = 0; j < NFIELDS; j++) avg[j] /= stats->count;
+    lua_newtable(L);
+    lua_pushinteger(L, (lua_Integer)stats->steps);
+    lua_setfield(L, -2, "steps");
+    lua_pushinteger(L, stats->count);
+    lua_setfield(L, -2, "samples");
+    pushsample(L, (const double*)&stats->samples[(stats->first + stats->count - 1) % stats->window]);
+    lua_setfield(L, -2, "last");
+    pushsample(L, min);
+    lua_setfield(L, -2, "min");
+    pushsample(L, avg);
+    lua_setfield(L, -2, "avg");
+    pushsample(L, max);
+    lua_setfield(L, -2, "max");
+    return 1;
+    }
+
 /* ----------------------------------------------------------------------- */
 
+static const struct luaL_Reg SpaceMethods[] =
+    {
+        { "set_step_stats", SetStepStats },
+        { "get_step_stats", GetStepStats },
+        { NULL, NULL } /* sentinel */
+    };
+
 static const struct luaL_Reg Functions[] = 
     {
         { "trace_objects", TraceObjects },
+        { "trace_start", TraceStart },
+        { "trace_stop", TraceStop },
+        { "trace_dump", TraceDump },
         { "now", Now },
         { "since", Since },
+        { "registry_stats", RegistryStats },
+        { "registry_reserve", RegistryReserve },
         { NULL, NULL } /* sentinel */
     };
 
 void moonchipmunk_open_tracing(lua_State *L)
     {
+    udata_addmethods(L, SPACE_MT, SpaceMethods);
     luaL_setfuncs(L, Functions, 0);
     }
 
@@ -25,51 +25,221 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include "tree.h"
 #include "udata.h"
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
 struct moonchipmunk_udata_s {
-    RB_ENTRY(moonchipmunk_udata_s) entry;
     uint64_t id; /* object id (search key) */
     /* references on the Lua registry */
     int ref;    /* the correspoding userdata */
     void *mem;  /* userdata memory area allocated and released by Lua */
     const char *mt;
+    udata_t *next; /* next node in the free list */
 };
 
 #define UNEXPECTED_ERROR "unexpected error (%s, %d)", __FILE__, __LINE__
 
-static int cmp(udata_t *udata1, udata_t *udata2) /* the compare function */
-    { return (udata1->id < udata2->id ? -1 : udata1->id > udata2->id); } 
-
-static RB_HEAD(udatatree_s, udata_s) Head = RB_INITIALIZER(&Head);
-
-RB_PROTOTYPE_STATIC(udatatree_s, udata_s, entry, cmp) 
-RB_GENERATE_STATIC(udatatree_s, udata_s, entry, cmp) 
- 
-static udata_t *udata_remove(udata_t *udata) 
-    { return RB_REMOVE(udatatree_s, &Head, udata); }
-static udata_t *udata_insert(udata_t *udata) 
-    { return RB_INSERT(udatatree_s, &Head, udata); }
-static udata_t *udata_search(uint64_t id) 
-    { udata_t tmp; tmp.id = id; return RB_FIND(udatatree_s, &Head, &tmp); }
-static udata_t *udata_first(uint64_t id) 
-    { udata_t tmp; tmp.id = id; return RB_NFIND(udatatree_s, &Head, &tmp); }
-#if 0
-static udata_t *udata_next(udata_t *udata)
-    { return RB_NEXT(udatatree_s, &Head, udata); }
-static udata_t *udata_prev(udata_t *udata)
-    { return RB_PREV(udatatree_s, &Head, udata); }
-static udata_t *udata_min(void)
-    { return RB_MIN(udatatree_s, &Head); }
-static udata_t *udata_max(void)
-    { return RB_MAX(udatatree_s, &Head); }
-static udata_t *udata_root(void)
-    { return RB_ROOT(&Head); }
-#endif
+/*------------------------------------------------------------------------------*
+ | Per-state registry                                                           |
+ *------------------------------------------------------------------------------*/
+
+/* Each Lua state has its own registry (id -> udata), which is kept in a userdata
+ * stored in the Lua registry, and released when the state is closed.
+ *
+ * The registry is an open-addressing hash table with linear probing, keyed by
+ * the object id. Its size is always a power of 2 and it is kept at most 3/4 full,
+ * so that searches, insertions and removals are O(1) on average.
+ * Removals use backward-shift deletion, so no tombstones are needed.
+ *
+ * udata nodes are allocated in slabs of SLAB_SIZE nodes and recycled through
+ * a free list, so that creating and deleting objects does not hit the allocator
+ * every time. Slabs are released only when the registry is.
+ */
+
+#define SLAB_SIZE 256
+#define MIN_TABLE_SIZE 256
+#define MAX_TABLE_COUNT(size) ((size) - (size)/4)
+
+typedef struct slab_s {
+    struct slab_s *next;
+    udata_t node[SLAB_SIZE];
+} slab_t;
+
+typedef struct {
+    uint64_t id;
+    udata_t *udata; /* NULL if the bucket is empty */
+} bucket_t;
+
+typedef struct {
+    /* pool of nodes */
+    slab_t *slabs;          /* list of allocated slabs */
+    udata_t *freenodes;     /* list of free nodes */
+    size_t capacity;        /* total no. of nodes in the slabs */
+    size_t live;            /* no. of nodes in use */
+    size_t highwater;       /* max no. of nodes ever in use */
+    /* hash table */
+    bucket_t *table;
+    size_t size;            /* no. of buckets (0 or a power of 2) */
+    size_t count;           /* no. of used buckets */
+} registry_t;
+
+static const char RegistryKey = 0; /* its address is the key in the Lua registry */
+
+static void registry_free(lua_State *L, registry_t *R)
+    {
+    slab_t *slab;
+    while((slab = R->slabs) != NULL)
+        {
+        R->slabs = slab->next;
+        Free(L, slab);
+        }
+    if(R->table) Free(L, R->table);
+    memset(R, 0, sizeof(registry_t));
+    }
+
+static int RegistryGC(lua_State *L)
+    {
+    registry_free(L, (registry_t*)lua_touserdata(L, 1));
+    return 0;
+    }
+
+static registry_t *getregistry(lua_State *L)
+/* returns the registry for the state, creating it if needed */
+    {
+    registry_t *R;
+    if(lua_rawgetp(L, LUA_REGISTRYINDEX, &RegistryKey) == LUA_TUSERDATA)
+        {
+        R = (registry_t*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return R;
+        }
+    lua_pop(L, 1);
+    R = (registry_t*)lua_newuserdata(L, sizeof(registry_t));
+    memset(R, 0, sizeof(registry_t));
+    lua_newtable(L); /* its metatable */
+    lua_pushcfunction(L, RegistryGC);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &RegistryKey);
+    return R;
+    }
+
+static void pool_grow(lua_State *L, registry_t *R)
+    {
+    int i;
+    slab_t *slab = (slab_t*)Malloc(L, sizeof(slab_t));
+    slab->next = R->slabs;
+    R->slabs = slab;
+    for(i = SLAB_SIZE - 1; i >= 0; i--)
+        {
+        slab->node[i].next = R->freenodes;
+        R->freenodes = &slab->node[i];
+        }
+    R->capacity += SLAB_SIZE;
+    }
+
+static udata_t *node_alloc(lua_State *L, registry_t *R)
+    {
+    udata_t *udata;
+    if(!R->freenodes) pool_grow(L, R);
+    udata = R->freenodes;
+    R->freenodes = udata->next;
+    memset(udata, 0, sizeof(udata_t));
+    if(++R->live > R->highwater) R->highwater = R->live;
+    return udata;
+    }
+
+static void node_free(registry_t *R, udata_t *udata)
+    {
+    udata->next = R->freenodes;
+    R->freenodes = udata;
+    R->live--;
+    }
+
+static size_t hash(uint64_t id)
+/* Fibonacci hashing (ids are typically pointers, whose low bits are mostly zeros) */
+    {
+    id *= UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(id ^ (id >> 32));
+    }
+
+static void table_resize(lua_State *L, registry_t *R, size_t size)
+    {
+    size_t i, j, mask = size - 1;
+    bucket_t *table = (bucket_t*)Malloc(L, size*sizeof(bucket_t));
+    memset(table, 0, size*sizeof(bucket_t));
+    for(i = 0; i < R->size; i++)
+        {
+        if(!R->table[i].udata) continue;
+        j = hash(R->table[i].id) & mask;
+        while(table[j].udata) j = (j + 1) & mask;
+        table[j] = R->table[i];
+        }
+    if(R->table) Free(L, R->table);
+    R->table = table;
+    R->size = size;
+    }
+
+static size_t table_find(registry_t *R, uint64_t id)
+/* returns the index of the bucket containing id, or R->size if not found */
+    {
+    size_t i, mask = R->size - 1;
+    if(R->size == 0) return 0;
+    i = hash(id) & mask;
+    while(R->table[i].udata)
+        {
+        if(R->table[i].id == id) return i;
+        i = (i + 1) & mask;
+        }
+    return R->size;
+    }
+
+static udata_t *udata_search(registry_t *R, uint64_t id)
+    {
+    size_t i = table_find(R, id);
+    return i < R->size ? R->table[i].udata : NULL;
+    }
+
+static void udata_insert(lua_State *L, registry_t *R, udata_t *udata)
+    {
+    size_t i, mask;
+    if(R->count + 1 > MAX_TABLE_COUNT(R->size))
+        table_resize(L, R, R->size == 0 ? MIN_TABLE_SIZE : 2*R->size);
+    mask = R->size - 1;
+    i = hash(udata->id) & mask;
+    while(R->table[i].udata) i = (i + 1) & mask;
+    R->table[i].id = udata->id;
+    R->table[i].udata = udata;
+    R->count++;
+    }
+
+static void udata_remove(registry_t *R, udata_t *udata)
+    {
+    size_t i, j, k, mask = R->size - 1;
+    bucket_t *table = R->table;
+    if((i = table_find(R, udata->id)) == R->size) return;
+    /* backward-shift the entries following i in the same cluster */
+    j = i;
+    for(;;)
+        {
+        j = (j + 1) & mask;
+        if(!table[j].udata) break;
+        k = hash(table[j].id) & mask; /* home bucket of the entry in j */
+        if((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+            continue; /* k is cyclically in (i, j]: the entry can't move to i */
+        table[i] = table[j];
+        i = j;
+        }
+    table[i].id = 0;
+    table[i].udata = NULL;
+    R->count--;
+    }
+
+/*------------------------------------------------------------------------------*
+ | udata                                                                        |
+ *------------------------------------------------------------------------------*/
 
 void *udata_new(lua_State *L, size_t size, uint64_t id_, const char *mt)
 /* Creates a new Lua userdata, optionally sets its metatable to mt (if != NULL),
@@ -82,28 +252,26 @@ void *udata_new(lua_State *L, size_t size, uint64_t id_, const char *mt)
  * (this function returnes it).
  */
     {
-    udata_t *udata;
-    if((udata = (udata_t*)Malloc(L, sizeof(udata_t))) == NULL) 
-        { luaL_error(L, "cannot allocate memory"); return NULL; }
-    memset(udata, 0, sizeof(udata_t));
+    registry_t *R = getregistry(L);
+    udata_t *udata = node_alloc(L, R);
     udata->mem = lua_newuserdata(L, size);
     if(!udata->mem)
         {
-        Free(L, udata);
+        node_free(R, udata);
         luaL_error(L, "lua_newuserdata error"); 
         return NULL;
         }
     udata->id = id_ != 0 ? id_ : (uint64_t)(uintptr_t)(udata->mem);
-    if(udata_search(udata->id))
+    if(udata_search(R, udata->id))
         { 
-        Free(L, udata);
+        node_free(R, udata);
         luaL_error(L, "duplicated object %I", id_); 
         return NULL; 
         }
     /* create a reference for later push's */
     lua_pushvalue(L, -1); /* the newly created userdata */
     udata->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    udata_insert(udata);
+    udata_insert(L, R, udata);
     if(mt)
         {
         udata->mt = mt;
@@ -113,9 +281,9 @@ void *udata_new(lua_State *L, size_t size, uint64_t id_, const char *mt)
     return udata->mem;
     }
 
-void *udata_mem(uint64_t id)
+void *udata_mem(lua_State *L, uint64_t id)
     {
-    udata_t *udata = udata_search(id);
+    udata_t *udata = udata_search(getregistry(L), id);
     return udata ? udata->mem : NULL;
     }
 
@@ -123,7 +291,7 @@ int udata_unref(lua_State *L, uint64_t id)
 /* unreference udata so that it will be garbage collected */
     {
 //  printf("unref object %lu\n", id);
-    udata_t *udata = udata_search(id);
+    udata_t *udata = udata_search(getregistry(L), id);
     if(!udata) 
         return luaL_error(L, "invalid object identifier %p", id);
     if(udata->ref != LUA_NOREF)
@@ -138,15 +306,16 @@ int udata_free(lua_State *L, uint64_t id)
 /* this should be called in the __gc metamethod
  */
     {
-    udata_t *udata = udata_search(id);
+    registry_t *R = getregistry(L);
+    udata_t *udata = udata_search(R, id);
 //  printf("free object %lu\n", id);
     if(!udata) 
         return luaL_error(L, "invalid object identifier %p", id);
     /* release all references */
     if(udata->ref != LUA_NOREF)
         luaL_unref(L, LUA_REGISTRYINDEX, udata->ref);
-    udata_remove(udata);
-    Free(L, udata);
+    udata_remove(R, udata);
+    node_free(R, udata);
     /* mem is released by Lua at garbage collection */
     return 0;
     }
@@ -154,7 +323,7 @@ int udata_free(lua_State *L, uint64_t id)
 
 int udata_push(lua_State *L, uint64_t id)
     {
-    udata_t *udata = udata_search(id);
+    udata_t *udata = udata_search(getregistry(L), id);
     if(!udata) 
         return luaL_error(L, "invalid object identifier %p", id);
     if(udata->ref == LUA_NOREF)
@@ -165,14 +334,28 @@ int udata_push(lua_State *L, uint64_t id)
     }
 
 void udata_free_all(lua_State *L)
-/* free all without unreferencing (for atexit()) */
+/* free all without unreferencing (the registry is also released when the state is closed) */
     {
-    udata_t *udata;
-    while((udata = udata_first(0)))
-        {
-        udata_remove(udata);
-        Free(L, udata);
-        }
+    registry_free(L, getregistry(L));
+    }
+
+void udata_reserve(lua_State *L, size_t n)
+/* preallocates room for n objects in the registry */
+    {
+    registry_t *R = getregistry(L);
+    size_t size = R->size == 0 ? MIN_TABLE_SIZE : R->size;
+    while(R->capacity < n) pool_grow(L, R);
+    while(MAX_TABLE_COUNT(size) < n) size *= 2;
+    if(size != R->size) table_resize(L, R, size);
+    }
+
+void udata_stats(lua_State *L, size_t *live, size_t *capacity, size_t *highwater)
+/* retrieves statistics on the pool of registry nodes */
+    {
+    registry_t *R = getregistry(L);
+    *live = R->live;
+    *capacity = R->capacity;
+    *highwater = R->highwater;
     }
 
 int udata_scan(lua_State *L, const char *mt,  
@@ -183,19 +366,30 @@ int udata_scan(lua_State *L, const char *mt,
  * returns 1 if interrupted, 0 otherwise
  */
     {
-    int stop = 0;
-    uint64_t id = 0;
+    int stop = 0, idx;
+    size_t i, n = 0;
+    uint64_t *ids;
     udata_t *udata;
-    while((udata = udata_first(id)))
+    registry_t *R = getregistry(L);
+    /* The callback may alter the table, so we first collect the ids of the
+     * objects to be visited, and then search them again one by one.
+     * The ids are kept in a userdata, so that the GC releases them if the
+     * callback raises an error. */
+    for(i = 0; i < R->size; i++)
+        if(R->table[i].udata && (R->table[i].udata->mt == mt)) n++;
+    if(n == 0) return 0;
+    ids = (uint64_t*)lua_newuserdata(L, n*sizeof(uint64_t));
+    idx = lua_gettop(L);
+    n = 0;
+    for(i = 0; i < R->size; i++)
+        if(R->table[i].udata && (R->table[i].udata->mt == mt)) ids[n++] = R->table[i].id;
+    for(i = 0; i < n && !stop; i++)
         {
-        id = udata->id + 1;
-        if(mt == udata->mt)
-            {
+        if((udata = udata_search(R, ids[i])) && (udata->mt == mt))
             stop = func(L, (const void*)(udata->mem), mt, info);
-            if(stop) return 1;
-            }
         }
-    return 0;
+    lua_remove(L, idx);
+    return stop ? 1 : 0;
     }
 
 
@@ -51,11 +51,15 @@ int udata_unref(lua_State *L, uint64_t);
 #define udata_free moonchipmunk_udata_free
 int udata_free(lua_State*, uint64_t);
 #define udata_mem moonchipmunk_udata_mem
-void *udata_mem(uint64_t);
+void *udata_mem(lua_State*, uint64_t);
 #define udata_push moonchipmunk_udata_push
 int udata_push(lua_State*, uint64_t);
 #define udata_free_all moonchipmunk_udata_free_all
 void udata_free_all(lua_State *L);
+#define udata_reserve moonchipmunk_udata_reserve
+void udata_reserve(lua_State *L, size_t n);
+#define udata_stats moonchipmunk_udata_stats
+void udata_stats(lua_State *L, size_t *live, size_t *capacity, size_t *highwater);
 #define udata_scan moonchipmunk_udata_scan
 int udata_scan(lua_State *L, const char *mt,  
             void *info, int (*func)(lua_State *L, const void *mem, const char* mt, const void *info));
@@ -43,34 +43,36 @@ int notavailable(lua_State *L, ...)
  *------------------------------------------------------------------------------*/
 
 /* We do not use malloc(), free() etc directly. Instead, we inherit the memory 
- * allocator from the main Lua state instead (see lua_getallocf in the Lua manual)
- * and use that.
+ * allocator from the Lua state (see lua_getallocf in the Lua manual) and use that.
  *
  * By doing so, we can use an alternative malloc() implementation without recompiling
  * this library (we have needs to recompile lua only, or execute it with LD_PRELOAD
  * set to the path to the malloc library we want to use).
+ *
+ * The allocator is retrieved from the state at each call (instead of being stored
+ * in a global variable), so that different states may use different allocators.
  */
-static lua_Alloc Alloc = NULL;
-static void* AllocUd = NULL;
 
-static void malloc_init(lua_State *L)
+static void* Malloc_(lua_State *L, size_t size)
     {
-    if(Alloc) unexpected(L);
-    Alloc = lua_getallocf(L, &AllocUd);
+    void *ud;
+    lua_Alloc alloc = lua_getallocf(L, &ud);
+    return alloc(ud, NULL, 0, size);
     }
 
-static void* Malloc_(size_t size)
-    { return Alloc ? Alloc(AllocUd, NULL, 0, size) : NULL; }
-
-static void Free_(void *ptr)
-    { if(Alloc) Alloc(AllocUd, ptr, 0, 0); }
+static void Free_(lua_State *L, void *ptr)
+    {
+    void *ud;
+    lua_Alloc alloc = lua_getallocf(L, &ud);
+    alloc(ud, ptr, 0, 0);
+    }
 
 void *Malloc(lua_State *L, size_t size)
     {
     void *ptr;
     if(size == 0)
         { luaL_error(L, errstring(ERR_MALLOC_ZERO)); return NULL; }
-    ptr = Malloc_(size);
+    ptr = Malloc_(L, size);
     if(ptr==NULL)
         { luaL_error(L, errstring(ERR_MEMORY)); return NULL; }
     memset(ptr, 0, size);
@@ -80,8 +82,7 @@ void *Malloc(lua_State *L, size_t size)
 
 void *MallocNoErr(lua_State *L, size_t size) /* do not raise errors (check the retval) */
     {
-    void *ptr = Malloc_(size);
-    (void)L;
+    void *ptr = Malloc_(L, size);
     if(ptr==NULL)
         return NULL;
     memset(ptr, 0, size);
@@ -102,9 +103,8 @@ char *Strdup(lua_State *L, const char *s)
 
 void Free(lua_State *L, void *ptr)
     {
-    (void)L;
     //DBG("Free %p\n", ptr);
-    if(ptr) Free_(ptr);
+    if(ptr) Free_(L, ptr);
     }
 
 /*------------------------------------------------------------------------------*
@@ -351,7 +351,6 @@ const char* errstring(int err)
 
 void moonchipmunk_utils_init(lua_State *L)
     {
-    malloc_init(L);
     time_init(L);
     }
 